@@ -1,4 +1,27 @@
 LOCAL_PATH:= $(call my-dir)
+
+## levmar as it comes from upstream, built on its own so that its warnings
+## don't show up in the driver's -W -Wall build
+LEVMAR_SRC_FILES:= \
+	levmar-2.5/lm.c \
+	levmar-2.5/Axb.c \
+	levmar-2.5/misc.c
+LEVMAR_CFLAGS:= -Wno-implicit-fallthrough -Wno-unused-but-set-variable -Wno-cpp -Wno-array-parameter
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES:= $(LEVMAR_SRC_FILES)
+LOCAL_CFLAGS:= -g -c -W -Wall -O2 -mtune=cortex-a9 -mfpu=neon -mfloat-abi=softfp -funsafe-math-optimizations -D_POSIX_SOURCE $(LEVMAR_CFLAGS)
+LOCAL_MODULE:=liblevmar_ts
+LOCAL_MODULE_TAGS:= eng
+include $(BUILD_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES:= $(LEVMAR_SRC_FILES)
+LOCAL_CFLAGS:= -g -W -Wall -O2 -D_GNU_SOURCE $(LEVMAR_CFLAGS)
+LOCAL_MODULE:=liblevmar_ts_host
+LOCAL_MODULE_TAGS:= optional
+include $(BUILD_HOST_STATIC_LIBRARY)
+
 include $(CLEAR_VARS)
 #
 ## TP Application
@@ -8,8 +31,16 @@ include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES:= \
 	ts_srv.c \
-	digitizer.c
+	digitizer.c \
+	trace.c \
+	assign.c \
+	frame_ring.c \
+	telemetry.c \
+	tap.c \
+	edge.c \
+	levmar-2.5/lmdemo.c
 LOCAL_CFLAGS:= -g -c -W -Wall -O2 -mtune=cortex-a9 -mfpu=neon -mfloat-abi=softfp -funsafe-math-optimizations -D_POSIX_SOURCE -I/home/green/touchpad/hp_tenderloin_kernel/include
+LOCAL_STATIC_LIBRARIES:= liblevmar_ts
 LOCAL_MODULE:=ts_srv
 LOCAL_MODULE_TAGS:= eng
 include $(BUILD_EXECUTABLE)
@@ -24,4 +55,26 @@ LOCAL_SRC_FILES:= \
 LOCAL_CFLAGS:= -g -c -W -Wall -O2 -mtune=cortex-a9 -mfpu=neon -mfloat-abi=softfp -funsafe-math-optimizations -D_POSIX_SOURCE -I/home/green/touchpad/hp_tenderloin_kernel/include
 LOCAL_MODULE:=ts_srv_set
 LOCAL_MODULE_TAGS:= eng
-include $(BUILD_EXECUTABLE)
\ No newline at end of file
+include $(BUILD_EXECUTABLE)
+
+
+## ts_srv_host is the same driver built for the host so that recorded
+## traces can be replayed and benchmarked with ts_srv_host -r / -b
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= \
+	ts_srv.c \
+	digitizer.c \
+	trace.c \
+	assign.c \
+	frame_ring.c \
+	telemetry.c \
+	tap.c \
+	edge.c \
+	levmar-2.5/lmdemo.c
+LOCAL_CFLAGS:= -g -W -Wall -O2 -D_GNU_SOURCE -idirafter $(LOCAL_PATH)/../include
+LOCAL_STATIC_LIBRARIES:= liblevmar_ts_host
+LOCAL_LDLIBS:= -lm -lrt -lpthread
+LOCAL_MODULE:=ts_srv_host
+LOCAL_MODULE_TAGS:= optional
+include $(BUILD_HOST_EXECUTABLE)
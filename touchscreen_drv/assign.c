@@ -0,0 +1,109 @@
+/*
+ * Minimum cost assignment of touches to the touches of the previous frame
+ * for the HP Touchpad userspace touchscreen driver.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *
+ * Copyright (c) 2012 CyanogenMod Touchpad Project.
+ *
+ *
+ */
+
+#include "assign.h"
+
+#define ASSIGN_INF 0x7FFFFFFF
+
+void assign_min_cost(int rows, int cols, int cost[][ASSIGN_MAX], int gate,
+	int *row_to_col)
+{
+	// Hungarian method with shortest augmenting paths, O(n^3) for an n x n
+	// problem. The problem is padded to be square. Padded rows cost
+	// nothing so they soak up previous touches that are no longer around,
+	// padded cols cost gate + 1 the same as a pair that is too far apart.
+	// Everything is 1 based here with row / col 0 used by the algorithm.
+	int n = rows > cols ? rows : cols;
+	int u[ASSIGN_MAX + 1], v[ASSIGN_MAX + 1];
+	int col_row[ASSIGN_MAX + 1], way[ASSIGN_MAX + 1];
+	int min_slack[ASSIGN_MAX + 1], used[ASSIGN_MAX + 1];
+	int i, j, row, col, next_col, delta, slack, c;
+
+	for (j=0; j<=n; j++) {
+		u[j] = 0;
+		v[j] = 0;
+		col_row[j] = 0;
+		way[j] = 0;
+	}
+
+	for (i=1; i<=n; i++) {
+		// Add row i and grow a path of tight edges from it until it ends
+		// at a col that isn't assigned yet
+		col_row[0] = i;
+		col = 0;
+		for (j=0; j<=n; j++) {
+			min_slack[j] = ASSIGN_INF;
+			used[j] = 0;
+		}
+		do {
+			used[col] = 1;
+			row = col_row[col];
+			delta = ASSIGN_INF;
+			next_col = 0;
+			for (j=1; j<=n; j++) {
+				if (used[j])
+					continue;
+				if (row > rows)
+					c = 0;
+				else if (j > cols || cost[row - 1][j - 1] > gate)
+					c = gate + 1;
+				else
+					c = cost[row - 1][j - 1];
+				slack = c - u[row] - v[j];
+				if (slack < min_slack[j]) {
+					min_slack[j] = slack;
+					way[j] = col;
+				}
+				if (min_slack[j] < delta) {
+					delta = min_slack[j];
+					next_col = j;
+				}
+			}
+			for (j=0; j<=n; j++) {
+				if (used[j]) {
+					u[col_row[j]] += delta;
+					v[j] -= delta;
+				} else {
+					min_slack[j] -= delta;
+				}
+			}
+			col = next_col;
+		} while (col_row[col]);
+
+		// Flip the assignments along the path
+		do {
+			next_col = way[col];
+			col_row[col] = col_row[next_col];
+			col = next_col;
+		} while (col);
+	}
+
+	for (i=0; i<rows; i++)
+		row_to_col[i] = -1;
+	for (j=1; j<=cols; j++) {
+		row = col_row[j];
+		if (row && row <= rows && cost[row - 1][j - 1] <= gate)
+			row_to_col[row - 1] = j - 1;
+	}
+}
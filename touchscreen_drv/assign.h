@@ -0,0 +1,35 @@
+/*
+ * Minimum cost assignment of touches to the touches of the previous frame
+ * for the HP Touchpad userspace touchscreen driver.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *
+ * Copyright (c) 2012 CyanogenMod Touchpad Project.
+ *
+ *
+ */
+
+// Largest number of touches on either side of an assignment, must be at
+// least MAX_TOUCH
+#define ASSIGN_MAX 10
+
+// Assigns each of the rows (current touches) to at most one of the cols
+// (previous touches) so that the sum of the costs is as small as possible.
+// Pairs that cost more than gate are never assigned, and leaving a row
+// unassigned costs gate + 1. row_to_col is set to the assigned col for
+// each row or -1.
+void assign_min_cost(int rows, int cols, int cost[][ASSIGN_MAX], int gate,
+	int *row_to_col);
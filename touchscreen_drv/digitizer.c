@@ -28,134 +28,161 @@
 #include <sys/ioctl.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <unistd.h>
 
 #include "digitizer.h"
 
 static int vdd_fd, xres_fd, wake_fd, i2c_fd, ts_state;
+// Power sequence in progress: the state being switched to, the next step
+// and the number of wake up retries so far
+static int power_target, power_step = -1, retry_count;
 
-void touchscreen_power(int enable)
+static void write_pin(int fd, const char *value, const char *error)
 {
-    struct i2c_rdwr_ioctl_data i2c_ioctl_data;
-    struct i2c_msg i2c_msg;
-    __u8 i2c_buf[16];
-    int rc;
-
-    if (enable && !ts_state) {
-		int retry_count = 0;
-try_again:
-		/* Set reset so the chip immediatelly sees it */
-        lseek(xres_fd, 0, SEEK_SET);
-        rc = write(xres_fd, "1", 1);
-		if (rc != 1)
-			printf("TSpower, failed set xres");
+	int rc;
 
-		/* Then power on */
-        lseek(vdd_fd, 0, SEEK_SET);
-        rc = write(vdd_fd, "1", 1);
-		if (rc != 1)
-			printf("TSpower, failed to enable vdd");
+	lseek(fd, 0, SEEK_SET);
+	rc = write(fd, value, 1);
+	if (rc != 1 && error)
+		printf("%s", error);
+}
+
+static int power_on_step(void)
+{
+	struct i2c_rdwr_ioctl_data i2c_ioctl_data;
+	struct i2c_msg i2c_msg;
+	__u8 i2c_buf[16];
+	int rc;
 
+	switch (power_step++) {
+	case 0:
+		/* Set reset so the chip immediatelly sees it */
+		write_pin(xres_fd, "1", "TSpower, failed set xres");
+		/* Then power on */
+		write_pin(vdd_fd, "1", "TSpower, failed to enable vdd");
 		/* Sleep some more for the voltage to stabilize */
-        usleep(50000);
-
-        lseek(wake_fd, 0, SEEK_SET);
-        rc = write(wake_fd, "1", 1);
-		if (rc != 1)
-			printf("TSpower, failed to assert wake");
-
-        lseek(xres_fd, 0, SEEK_SET);
-        rc = write(xres_fd, "0", 1);
-		if (rc != 1)
-			printf("TSpower, failed to reset xres");
-
-        usleep(50000);
-
-        lseek(wake_fd, 0, SEEK_SET);
-        rc = write(wake_fd, "0", 1);
-		if (rc != 1)
-			printf("TSpower, failed to deassert wake");
-
-        usleep(50000);
-
-        i2c_ioctl_data.nmsgs = 1;
-        i2c_ioctl_data.msgs = &i2c_msg;
-
-        i2c_msg.addr = 0x67;
-        i2c_msg.flags = 0;
-        i2c_msg.buf = i2c_buf;
-
-        i2c_msg.len = 2;
-        i2c_buf[0] = 0x08; i2c_buf[1] = 0;
-        rc = ioctl(i2c_fd,I2C_RDWR,&i2c_ioctl_data);
-		if (rc != 1)
-			printf("TSPower, ioctl1 failed %d errno %d\n", rc, errno);
-		/* Ok, so the TS failed to wake, we need to retry a few times
-         * before totally giving up */
-		if ((rc != 1) && (retry_count++ < MAX_DIGITIZER_RETRY)) {
-			lseek(vdd_fd, 0, SEEK_SET);
-			rc = write(vdd_fd, "0", 1);
-			usleep(10000);
-			printf("TS wakeup retry #%d\n", retry_count);
-			goto try_again;
-		}
-
-        i2c_msg.len = 6;
-        i2c_buf[0] = 0x31; i2c_buf[1] = 0x01; i2c_buf[2] = 0x08;
-        i2c_buf[3] = 0x0C; i2c_buf[4] = 0x0D; i2c_buf[5] = 0x0A;
-        rc = ioctl(i2c_fd,I2C_RDWR,&i2c_ioctl_data);
-		if (rc != 1)
-			printf("TSPower, ioctl2 failed %d errno %d\n", rc, errno);
-
-        i2c_msg.len = 2;
-        i2c_buf[0] = 0x30; i2c_buf[1] = 0x0F;
-        rc = ioctl(i2c_fd,I2C_RDWR,&i2c_ioctl_data);
-		if (rc != 1)
-			printf("TSPower, ioctl3 failed %d errno %d\n", rc, errno);
-
-        i2c_buf[0] = 0x40; i2c_buf[1] = 0x02;
-        rc = ioctl(i2c_fd,I2C_RDWR,&i2c_ioctl_data);
-		if (rc != 1)
-			printf("TSPower, ioctl4 failed %d errno %d\n", rc, errno);
-
-        i2c_buf[0] = 0x41; i2c_buf[1] = 0x10;
-        rc = ioctl(i2c_fd,I2C_RDWR,&i2c_ioctl_data);
-		if (rc != 1)
-			printf("TSPower, ioctl5 failed %d errno %d\n", rc, errno);
-
-        i2c_buf[0] = 0x0A; i2c_buf[1] = 0x04;
-        rc = ioctl(i2c_fd,I2C_RDWR,&i2c_ioctl_data);
-		if (rc != 1)
-			printf("TSPower, ioctl6 failed %d errno %d\n", rc, errno);
-
-        i2c_buf[0] = 0x08; i2c_buf[1] = 0x03;
-        rc = ioctl(i2c_fd,I2C_RDWR,&i2c_ioctl_data);
-		if (rc != 1)
-			printf("TSPower, ioctl7 failed %d errno %d\n", rc, errno);
-
-        lseek(wake_fd, 0, SEEK_SET);
-        rc = write(wake_fd, "1", 1);
-		if (rc != 1)
-			printf("TSpower, failed to assert wake again");
-		ts_state = 1;
-    } else if (ts_state) {
-        lseek(vdd_fd, 0, SEEK_SET);
-        rc = write(vdd_fd, "0", 1);
-		if (rc != 1)
-			printf("TSpower, failed to disable vdd");
+		return 50000;
+	case 1:
+		write_pin(wake_fd, "1", "TSpower, failed to assert wake");
+		write_pin(xres_fd, "0", "TSpower, failed to reset xres");
+		return 50000;
+	case 2:
+		write_pin(wake_fd, "0", "TSpower, failed to deassert wake");
+		return 50000;
+	}
+
+	i2c_ioctl_data.nmsgs = 1;
+	i2c_ioctl_data.msgs = &i2c_msg;
+
+	i2c_msg.addr = 0x67;
+	i2c_msg.flags = 0;
+	i2c_msg.buf = i2c_buf;
+
+	i2c_msg.len = 2;
+	i2c_buf[0] = 0x08; i2c_buf[1] = 0;
+	rc = ioctl(i2c_fd,I2C_RDWR,&i2c_ioctl_data);
+	if (rc != 1)
+		printf("TSPower, ioctl1 failed %d errno %d\n", rc, errno);
+	/* Ok, so the TS failed to wake, we need to retry a few times
+	 * before totally giving up */
+	if ((rc != 1) && (retry_count++ < MAX_DIGITIZER_RETRY)) {
+		write_pin(vdd_fd, "0", NULL);
+		printf("TS wakeup retry #%d\n", retry_count);
+		power_step = 0;
+		return 10000;
+	}
+
+	i2c_msg.len = 6;
+	i2c_buf[0] = 0x31; i2c_buf[1] = 0x01; i2c_buf[2] = 0x08;
+	i2c_buf[3] = 0x0C; i2c_buf[4] = 0x0D; i2c_buf[5] = 0x0A;
+	rc = ioctl(i2c_fd,I2C_RDWR,&i2c_ioctl_data);
+	if (rc != 1)
+		printf("TSPower, ioctl2 failed %d errno %d\n", rc, errno);
+
+	i2c_msg.len = 2;
+	i2c_buf[0] = 0x30; i2c_buf[1] = 0x0F;
+	rc = ioctl(i2c_fd,I2C_RDWR,&i2c_ioctl_data);
+	if (rc != 1)
+		printf("TSPower, ioctl3 failed %d errno %d\n", rc, errno);
+
+	i2c_buf[0] = 0x40; i2c_buf[1] = 0x02;
+	rc = ioctl(i2c_fd,I2C_RDWR,&i2c_ioctl_data);
+	if (rc != 1)
+		printf("TSPower, ioctl4 failed %d errno %d\n", rc, errno);
+
+	i2c_buf[0] = 0x41; i2c_buf[1] = 0x10;
+	rc = ioctl(i2c_fd,I2C_RDWR,&i2c_ioctl_data);
+	if (rc != 1)
+		printf("TSPower, ioctl5 failed %d errno %d\n", rc, errno);
+
+	i2c_buf[0] = 0x0A; i2c_buf[1] = 0x04;
+	rc = ioctl(i2c_fd,I2C_RDWR,&i2c_ioctl_data);
+	if (rc != 1)
+		printf("TSPower, ioctl6 failed %d errno %d\n", rc, errno);
+
+	i2c_buf[0] = 0x08; i2c_buf[1] = 0x03;
+	rc = ioctl(i2c_fd,I2C_RDWR,&i2c_ioctl_data);
+	if (rc != 1)
+		printf("TSPower, ioctl7 failed %d errno %d\n", rc, errno);
+
+	write_pin(wake_fd, "1", "TSpower, failed to assert wake again");
+	ts_state = 1;
+	return 0;
+}
+
+static int power_off_step(void)
+{
+	switch (power_step++) {
+	case 0:
+		write_pin(vdd_fd, "0", "TSpower, failed to disable vdd");
 
 		/* Weird, but on 4G touchpads even after vdd is off there is still
 		 * stream of data from ctp that only disappears after we reset the
 		 * touchscreen, even though it's supposedly powered off already
 		 */
-        lseek(xres_fd, 0, SEEK_SET);
-        rc = write(xres_fd, "1", 1);
-		usleep(10000);
-        lseek(xres_fd, 0, SEEK_SET);
-        rc = write(xres_fd, "0", 1);
-        /* XXX, should be correllated with LIFTOFF_TIMEOUT in ts driver */
-        usleep(80000);
-		ts_state = 0;
-    }
+		write_pin(xres_fd, "1", NULL);
+		return 10000;
+	case 1:
+		write_pin(xres_fd, "0", NULL);
+		/* XXX, should be correllated with LIFTOFF_TIMEOUT in ts driver */
+		return 80000;
+	}
+	ts_state = 0;
+	return 0;
+}
+
+int touchscreen_power_step(void)
+{
+	int wait;
+
+	if (power_step < 0)
+		return 0;
+	wait = power_target ? power_on_step() : power_off_step();
+	if (!wait)
+		power_step = -1;
+	return wait;
+}
+
+int touchscreen_power_start(int enable)
+{
+	// A sequence that is still running is dropped and the new one starts
+	// from the beginning
+	if (power_step < 0 && (enable ? ts_state : !ts_state))
+		return 0;
+	power_target = enable;
+	power_step = 0;
+	retry_count = 0;
+	return touchscreen_power_step();
+}
+
+void touchscreen_power(int enable)
+{
+	int wait = touchscreen_power_start(enable);
+
+	while (wait > 0) {
+		usleep(wait);
+		wait = touchscreen_power_step();
+	}
 }
 
 void init_digitizer_fd(void) {
@@ -25,6 +25,14 @@
 // Maximum number of times to retry powering on the digitizer
 #define MAX_DIGITIZER_RETRY 3
 
+// Powers the digitizer on or off, sleeping until it is done
 void touchscreen_power(int enable);
 
+// Starts powering the digitizer on or off without sleeping. Returns the
+// number of microseconds to wait before calling touchscreen_power_step,
+// or 0 once the digitizer is done.
+int touchscreen_power_start(int enable);
+
+int touchscreen_power_step(void);
+
 void init_digitizer_fd(void);
\ No newline at end of file
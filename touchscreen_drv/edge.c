@@ -0,0 +1,270 @@
+/*
+ * Edge correction table for the HP Touchpad userspace touchscreen driver.
+ * Touches near the edges of the digitizer are pulled toward the middle,
+ * the table moves them back out without fitting them in every frame.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *
+ * Copyright (c) 2012 CyanogenMod Touchpad Project.
+ *
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "edge.h"
+
+#define EDGE_ONE (1 << EDGE_SHIFT)
+#define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
+#define MAX(X,Y) ((X) > (Y) ? (X) : (Y))
+
+static const struct edge_node *nodes;
+static int rows, cols;
+// Calibration sums for each node: weight, then the weighted offsets
+static double *calib;
+static int calib_touches;
+
+static void edge_cell(int loc, int size, int *n, int *frac)
+{
+	// Node above or left of a location and how far past it the location
+	// is, locations outside the matrix use the nodes at the edge
+	if (loc < 0)
+		loc = 0;
+	if (loc > (size - 1) << EDGE_SHIFT)
+		loc = (size - 1) << EDGE_SHIFT;
+	*n = loc >> EDGE_SHIFT;
+	if (*n == size - 1)
+		(*n)--;
+	*frac = loc - (*n << EDGE_SHIFT);
+}
+
+int edge_load(const char *path, int matrix_rows, int matrix_cols)
+{
+	const struct edge_header *header;
+	struct stat st;
+	size_t size = sizeof(struct edge_header) +
+		matrix_rows * matrix_cols * sizeof(struct edge_node);
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		printf("Unable to open edge table %s\n", path);
+		return -1;
+	}
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size != size) {
+		printf("Edge table %s is not for this digitizer\n", path);
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		printf("Unable to map edge table %s\n", path);
+		return -1;
+	}
+	header = map;
+	if (header->magic != EDGE_MAGIC || header->version != EDGE_VERSION ||
+		header->rows != (unsigned int)matrix_rows ||
+		header->cols != (unsigned int)matrix_cols) {
+		printf("Edge table %s is not for this digitizer\n", path);
+		munmap(map, size);
+		return -1;
+	}
+	nodes = (const struct edge_node *)(header + 1);
+	rows = matrix_rows;
+	cols = matrix_cols;
+	return 0;
+}
+
+int edge_loaded(void)
+{
+	return nodes != NULL;
+}
+
+void edge_correct(int *i, int *j)
+{
+	const struct edge_node *n;
+	int ni, nj, fi, fj, w00, w01, w10, w11, di, dj;
+
+	if (!nodes)
+		return;
+	edge_cell(*i, rows, &ni, &fi);
+	edge_cell(*j, cols, &nj, &fj);
+	w00 = (EDGE_ONE - fi) * (EDGE_ONE - fj);
+	w01 = (EDGE_ONE - fi) * fj;
+	w10 = fi * (EDGE_ONE - fj);
+	w11 = fi * fj;
+	n = &nodes[ni * cols + nj];
+	// The weights add up to 1 << (2 * EDGE_SHIFT)
+	di = n[0].di * w00 + n[1].di * w01 + n[cols].di * w10 +
+		n[cols + 1].di * w11;
+	dj = n[0].dj * w00 + n[1].dj * w01 + n[cols].dj * w10 +
+		n[cols + 1].dj * w11;
+	*i += (di + (1 << (2 * EDGE_SHIFT - 1))) >> (2 * EDGE_SHIFT);
+	*j += (dj + (1 << (2 * EDGE_SHIFT - 1))) >> (2 * EDGE_SHIFT);
+	// The fit never puts a touch outside the matrix either
+	*i = MIN(MAX(*i, 0), (rows - 1) << EDGE_SHIFT);
+	*j = MIN(MAX(*j, 0), (cols - 1) << EDGE_SHIFT);
+}
+
+int edge_calib_init(int matrix_rows, int matrix_cols)
+{
+	calib = calloc(matrix_rows * matrix_cols * 3, sizeof(double));
+	if (!calib) {
+		printf("Unable to allocate the edge calibration\n");
+		return -1;
+	}
+	rows = matrix_rows;
+	cols = matrix_cols;
+	return 0;
+}
+
+static void calib_add_node(int node, double weight, int di, int dj)
+{
+	calib[node * 3] += weight;
+	calib[node * 3 + 1] += weight * di;
+	calib[node * 3 + 2] += weight * dj;
+}
+
+void edge_calib_add(int raw_i, int raw_j, int fit_i, int fit_j)
+{
+	// The offset is shared out to the four nodes around the weighted
+	// average location the same way edge_correct() reads them back
+	int ni, nj, fi, fj, node, di = fit_i - raw_i, dj = fit_j - raw_j;
+	double wi, wj;
+
+	if (!calib)
+		return;
+	calib_touches++;
+	edge_cell(raw_i, rows, &ni, &fi);
+	edge_cell(raw_j, cols, &nj, &fj);
+	wi = (double)fi / EDGE_ONE;
+	wj = (double)fj / EDGE_ONE;
+	node = ni * cols + nj;
+	calib_add_node(node, (1 - wi) * (1 - wj), di, dj);
+	calib_add_node(node + 1, (1 - wi) * wj, di, dj);
+	calib_add_node(node + cols, wi * (1 - wj), di, dj);
+	calib_add_node(node + cols + 1, wi * wj, di, dj);
+}
+
+static short clamp_offset(double offset)
+{
+	if (offset > EDGE_MAX_OFFSET << EDGE_SHIFT)
+		return EDGE_MAX_OFFSET << EDGE_SHIFT;
+	if (offset < -(EDGE_MAX_OFFSET << EDGE_SHIFT))
+		return -(EDGE_MAX_OFFSET << EDGE_SHIFT);
+	return offset < 0 ? offset - 0.5 : offset + 0.5;
+}
+
+static int fill_table(struct edge_node *table, unsigned char *known,
+	unsigned char *next)
+{
+	// Returns -1 if there was nothing to calibrate with
+	static const int steps[4][2] = { {-1, 0}, {1, 0}, {0, -1}, {0, 1} };
+	int count = rows * cols, filled = 0, node, k, n, i, j, di, dj;
+
+	for (node=0; node<count; node++) {
+		if (calib[node * 3] < EDGE_MIN_WEIGHT)
+			continue;
+		table[node].di = clamp_offset(calib[node * 3 + 1] / calib[node * 3]);
+		table[node].dj = clamp_offset(calib[node * 3 + 2] / calib[node * 3]);
+		known[node] = 1;
+		filled++;
+	}
+	if (!filled)
+		return -1;
+	// Nodes that no touches came near get the average of the nodes next to
+	// them, working outward from the ones that are known
+	while (filled < count) {
+		memcpy(next, known, count);
+		for (node=0; node<count; node++) {
+			if (known[node])
+				continue;
+			di = dj = n = 0;
+			for (k=0; k<4; k++) {
+				i = node / cols + steps[k][0];
+				j = node % cols + steps[k][1];
+				if (i < 0 || i >= rows || j < 0 || j >= cols ||
+					!known[i * cols + j])
+					continue;
+				di += table[i * cols + j].di;
+				dj += table[i * cols + j].dj;
+				n++;
+			}
+			if (!n)
+				continue;
+			table[node].di = clamp_offset((double)di / n);
+			table[node].dj = clamp_offset((double)dj / n);
+			next[node] = 1;
+			filled++;
+		}
+		memcpy(known, next, count);
+	}
+	return 0;
+}
+
+static int write_table(const char *path, struct edge_node *table)
+{
+	struct edge_header header;
+	int size = rows * cols * sizeof(struct edge_node), fd, ret = 0;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		printf("Unable to open edge table %s for writing\n", path);
+		return -1;
+	}
+	header.magic = EDGE_MAGIC;
+	header.version = EDGE_VERSION;
+	header.rows = rows;
+	header.cols = cols;
+	if (write(fd, &header, sizeof(header)) != sizeof(header) ||
+		write(fd, table, size) != size) {
+		printf("Error writing edge table %s\n", path);
+		ret = -1;
+	}
+	close(fd);
+	return ret;
+}
+
+int edge_calib_write(const char *path)
+{
+	struct edge_node *table;
+	unsigned char *known;
+	int ret = -1;
+
+	if (!calib)
+		return -1;
+	table = calloc(rows * cols, sizeof(struct edge_node));
+	known = calloc(rows * cols, 2);
+	if (!table || !known)
+		printf("Unable to allocate the edge table\n");
+	else if (fill_table(table, known, known + rows * cols))
+		printf("No touches to calibrate the edges with\n");
+	else
+		ret = write_table(path, table);
+	if (!ret)
+		printf("Made edge table %s from %d touches\n", path, calib_touches);
+	free(table);
+	free(known);
+	return ret;
+}
@@ -0,0 +1,69 @@
+/*
+ * Edge correction table for the HP Touchpad userspace touchscreen driver.
+ * Touches near the edges of the digitizer are pulled toward the middle,
+ * the table moves them back out without fitting them in every frame.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *
+ * Copyright (c) 2012 CyanogenMod Touchpad Project.
+ *
+ *
+ */
+
+// Layout of a table file: a struct edge_header followed by rows * cols
+// struct edge_node, one for each point of the matrix in row major order.
+// The offset of a node is added to a touch centered on that point to move
+// it to where the Gaussian fit puts it. Offsets and touch locations are
+// in points with EDGE_SHIFT fractional bits, between the nodes the offsets
+// are interpolated bilinearly.
+#define EDGE_MAGIC 0x31474445 // "EDG1"
+#define EDGE_VERSION 1
+#define EDGE_SHIFT 8
+// Largest offset that is stored, in points
+#define EDGE_MAX_OFFSET 8
+// Nodes with less calibration weight than this are filled in from the
+// nodes around them
+#define EDGE_MIN_WEIGHT 1.0
+
+struct edge_header {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int rows;
+	unsigned int cols;
+};
+
+struct edge_node {
+	short di;
+	short dj;
+};
+
+// Maps a table for a matrix of rows x cols points, returns -1 if it
+// can't be used
+int edge_load(const char *path, int rows, int cols);
+
+// Whether a table is loaded
+int edge_loaded(void);
+
+// Moves a touch location by the offset at that location
+void edge_correct(int *i, int *j);
+
+// Calibration collects touches that were fitted along with their weighted
+// average locations, then writes out the table.
+int edge_calib_init(int rows, int cols);
+
+void edge_calib_add(int raw_i, int raw_j, int fit_i, int fit_j);
+
+int edge_calib_write(const char *path);
@@ -0,0 +1,144 @@
+/*
+ * Single producer, single consumer ring of digitizer frames for the HP
+ * Touchpad userspace touchscreen driver.  The uart reader thread fills
+ * frames and the processing thread takes them out without any locks.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *
+ * Copyright (c) 2012 CyanogenMod Touchpad Project.
+ *
+ *
+ */
+
+#include <string.h>
+
+#include "frame_ring.h"
+
+static unsigned char slots[FRAME_RING_SLOTS][FRAME_RING_SLOT_SIZE];
+static long long slot_read_ns[FRAME_RING_SLOTS];
+// head is only written by the producer and tail only by the consumer. Both
+// only ever count up, the slot is the count modulo FRAME_RING_SLOTS.
+static volatile unsigned int head, tail;
+// Number of the frame in the slot being filled and the rows of it handed
+// over so far, only written by the producer. The number changes before any
+// row that was handed over changes, so the consumer can tell that rows it
+// read may be stale.
+static volatile unsigned int write_number, write_rows;
+static unsigned int slot_number[FRAME_RING_SLOTS];
+
+struct frame_ring_stats frame_ring_stats;
+
+void frame_ring_init(void)
+{
+	head = 0;
+	tail = 0;
+	write_number = 0;
+	write_rows = 0;
+	memset(slots, 0, sizeof(slots));
+	memset(&frame_ring_stats, 0, sizeof(frame_ring_stats));
+}
+
+unsigned char *frame_ring_write_slot(void)
+{
+	return slots[head % FRAME_RING_SLOTS];
+}
+
+void frame_ring_publish(long long read_ns)
+{
+	unsigned int used = head - tail;
+
+	if (used == FRAME_RING_SLOTS - 1) {
+		frame_ring_stats.dropped++;
+		frame_ring_restart();
+		return;
+	}
+	memcpy(slots[(head + 1) % FRAME_RING_SLOTS],
+		slots[head % FRAME_RING_SLOTS], FRAME_RING_SLOT_SIZE);
+	slot_read_ns[head % FRAME_RING_SLOTS] = read_ns;
+	slot_number[head % FRAME_RING_SLOTS] = write_number;
+	// The frame has to be in memory before the consumer can see it
+	__sync_synchronize();
+	head++;
+	// The next slot starts out as a copy of this frame, so rows read from
+	// it before the new number is seen are still right for this frame
+	frame_ring_restart();
+	frame_ring_stats.published++;
+	if (used + 1 > frame_ring_stats.max_used)
+		frame_ring_stats.max_used = used + 1;
+}
+
+void frame_ring_publish_row(int row)
+{
+	// The row has to be in memory before the consumer can see it
+	__sync_synchronize();
+	write_rows |= 1U << row;
+}
+
+void frame_ring_restart(void)
+{
+	// Everything written so far has to be seen before the new number
+	__sync_synchronize();
+	write_number++;
+	// The new number has to be seen before the rows change
+	__sync_synchronize();
+	write_rows = 0;
+}
+
+unsigned char *frame_ring_read_slot(long long *read_ns, unsigned int *number)
+{
+	if (tail == head)
+		return NULL;
+	// Don't read the frame before seeing that it was published
+	__sync_synchronize();
+	*read_ns = slot_read_ns[tail % FRAME_RING_SLOTS];
+	*number = slot_number[tail % FRAME_RING_SLOTS];
+	return slots[tail % FRAME_RING_SLOTS];
+}
+
+void frame_ring_release(void)
+{
+	// Done reading the frame before the producer may fill the slot again
+	__sync_synchronize();
+	tail++;
+	frame_ring_stats.consumed++;
+}
+
+unsigned char *frame_ring_partial_slot(unsigned int *number,
+	unsigned int *rows)
+{
+	unsigned char *slot;
+
+	*number = write_number;
+	// Rows handed over before the number was read belong to that frame
+	__sync_synchronize();
+	slot = slots[head % FRAME_RING_SLOTS];
+	*rows = write_rows;
+	// Don't read the rows before seeing that they were handed over
+	__sync_synchronize();
+	return slot;
+}
+
+int frame_ring_partial_valid(unsigned int number)
+{
+	// Finish reading the rows before checking the number again
+	__sync_synchronize();
+	return write_number == number;
+}
+
+unsigned int frame_ring_used(void)
+{
+	return head - tail;
+}
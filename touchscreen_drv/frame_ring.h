@@ -0,0 +1,81 @@
+/*
+ * Single producer, single consumer ring of digitizer frames for the HP
+ * Touchpad userspace touchscreen driver.  The uart reader thread fills
+ * frames and the processing thread takes them out without any locks.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *
+ * Copyright (c) 2012 CyanogenMod Touchpad Project.
+ *
+ *
+ */
+
+// Bytes of digitizer data in a frame, the 30 x 40 matrix
+#define FRAME_RING_SLOT_SIZE 1200
+// Number of slots, one of them is always the one being filled so up to
+// FRAME_RING_SLOTS - 1 frames can wait to be processed. Must be a power of
+// 2.
+#define FRAME_RING_SLOTS 8
+
+struct frame_ring_stats {
+	// Frames handed to the processing thread and taken out by it
+	unsigned int published;
+	unsigned int consumed;
+	// Frames thrown away because the ring was full
+	unsigned int dropped;
+	// Most frames that were waiting at once
+	unsigned int max_used;
+};
+
+extern struct frame_ring_stats frame_ring_stats;
+
+void frame_ring_init(void);
+
+// Producer side: the slot to fill with the next frame and handing it over
+// along with the time it was read. If the ring is full the frame is dropped
+// and the same slot is filled again. Either way the next frame starts out
+// as a copy of this one.
+unsigned char *frame_ring_write_slot(void);
+
+void frame_ring_publish(long long read_ns);
+
+// Producer side, rows: each row written into the slot is handed over as
+// well, so that the consumer can work on the rows of a frame while the
+// rest of it is still arriving. frame_ring_restart() has to be called
+// before a row that was handed over is written again and when the rows in
+// the slot start over for a new frame.
+void frame_ring_publish_row(int row);
+
+void frame_ring_restart(void);
+
+// Consumer side: the oldest waiting frame with its read time and number or
+// NULL if there is none, and giving its slot back once it has been
+// processed.
+unsigned char *frame_ring_read_slot(long long *read_ns, unsigned int *number);
+
+void frame_ring_release(void);
+
+// Consumer side, rows: the slot being filled with the number of its frame
+// and the bitmap of the rows handed over so far. The rows may only be used
+// if frame_ring_partial_valid() says the frame is still the same after
+// they were read. A frame keeps its number when it is published.
+unsigned char *frame_ring_partial_slot(unsigned int *number,
+	unsigned int *rows);
+
+int frame_ring_partial_valid(unsigned int number);
+
+// Number of frames waiting to be processed
+unsigned int frame_ring_used(void);
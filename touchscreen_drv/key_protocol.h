@@ -0,0 +1,30 @@
+/*
+ * Key/value protocol of the HP Touchpad userspace touchscreen driver
+ * socket.  The driver and ts_srv_set both include this so that they agree
+ * on the line sizes.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *
+ * Copyright (c) 2012 CyanogenMod Touchpad Project.
+ *
+ *
+ */
+
+// Version of the key/value command protocol, it starts each line
+#define KEY_PROTOCOL_VERSION "K1"
+// Longest command line and longest reply line, each with its newline
+#define KEY_LINE_SIZE 512
+#define KEY_REPLY_SIZE 1024
@@ -33,6 +33,117 @@
 #define __STATIC__ // empty
 #endif /* LINSOLVERS_RETAIN_MEMORY */
 
+/*
+ * This function returns the solution of Ax = b using the LU decomposition
+ * followed by forward/back substitution, like the non-LAPACK LU solver below.
+ *
+ * A is mxm, b is mx1. buf is scratch memory of at least
+ * LM_LU_WORKSZ(m, sizeof(LM_REAL)) bytes supplied by the caller, which makes
+ * this function reentrant regardless of LINSOLVERS_RETAIN_MEMORY
+ *
+ * The function returns 0 in case of error, 1 if successful
+ */
+#define AX_EQ_B_LU_BUF LM_ADD_PREFIX(Ax_eq_b_LU_buf)
+
+int AX_EQ_B_LU_BUF(LM_REAL *A, LM_REAL *B, LM_REAL *x, int m, void *buf)
+{
+register int i, j, k;
+int *idx, maxi=-1, a_sz=m*m, work_sz=m;
+LM_REAL *a, *work, max, sum, tmp;
+
+  a=buf;
+  work=a+a_sz;
+  idx=(int *)(work+work_sz);
+
+  /* avoid destroying A, B by copying them to a, x resp. */
+  for(i=0; i<m; ++i){ // B & 1st row of A
+    a[i]=A[i];
+    x[i]=B[i];
+  }
+  for(  ; i<a_sz; ++i) a[i]=A[i]; // copy A's remaining rows
+  /****
+  for(i=0; i<m; ++i){
+    for(j=0; j<m; ++j)
+      a[i*m+j]=A[i*m+j];
+    x[i]=B[i];
+  }
+  ****/
+
+  /* compute the LU decomposition of a row permutation of matrix a; the permutation itself is saved in idx[] */
+	for(i=0; i<m; ++i){
+		max=0.0;
+		for(j=0; j<m; ++j)
+			if((tmp=FABS(a[i*m+j]))>max)
+        max=tmp;
+		  if(max==0.0){
+        fprintf(stderr, RCAT("Singular matrix A in ", AX_EQ_B_LU_BUF) "()!\n");
+        return 0;
+      }
+		  work[i]=LM_CNST(1.0)/max;
+	}
+
+	for(j=0; j<m; ++j){
+		for(i=0; i<j; ++i){
+			sum=a[i*m+j];
+			for(k=0; k<i; ++k)
+        sum-=a[i*m+k]*a[k*m+j];
+			a[i*m+j]=sum;
+		}
+		max=0.0;
+		for(i=j; i<m; ++i){
+			sum=a[i*m+j];
+			for(k=0; k<j; ++k)
+        sum-=a[i*m+k]*a[k*m+j];
+			a[i*m+j]=sum;
+			if((tmp=work[i]*FABS(sum))>=max){
+				max=tmp;
+				maxi=i;
+			}
+		}
+		if(j!=maxi){
+			for(k=0; k<m; ++k){
+				tmp=a[maxi*m+k];
+				a[maxi*m+k]=a[j*m+k];
+				a[j*m+k]=tmp;
+			}
+			work[maxi]=work[j];
+		}
+		idx[j]=maxi;
+		if(a[j*m+j]==0.0)
+      a[j*m+j]=LM_REAL_EPSILON;
+		if(j!=m-1){
+			tmp=LM_CNST(1.0)/(a[j*m+j]);
+			for(i=j+1; i<m; ++i)
+        a[i*m+j]*=tmp;
+		}
+	}
+
+  /* The decomposition has now replaced a. Solve the linear system using
+   * forward and back substitution
+   */
+	for(i=k=0; i<m; ++i){
+		j=idx[i];
+		sum=x[j];
+		x[j]=x[i];
+		if(k!=0)
+			for(j=k-1; j<i; ++j)
+        sum-=a[i*m+j]*x[j];
+		else
+      if(sum!=0.0)
+			  k=i+1;
+		x[i]=sum;
+	}
+
+	for(i=m-1; i>=0; --i){
+		sum=x[i];
+		for(j=i+1; j<m; ++j)
+      sum-=a[i*m+j]*x[j];
+		x[i]=sum/a[i*m+i];
+	}
+
+  return 1;
+}
+
 #ifdef HAVE_LAPACK
 
 /* prototypes of LAPACK routines */
@@ -994,9 +1105,7 @@ int AX_EQ_B_LU(LM_REAL *A, LM_REAL *B, LM_REAL *x, int m)
 __STATIC__ void *buf=NULL;
 __STATIC__ int buf_sz=0;
 
-register int i, j, k;
-int *idx, maxi=-1, idx_sz, a_sz, work_sz, tot_sz;
-LM_REAL *a, *work, max, sum, tmp;
+int idx_sz, a_sz, work_sz, tot_sz, ret;
 
     if(!A)
 #ifdef LINSOLVERS_RETAIN_MEMORY
@@ -1037,108 +1146,18 @@ LM_REAL *a, *work, max, sum, tmp;
     }
 #endif /* LINSOLVERS_RETAIN_MEMORY */
 
-  a=buf;
-  work=a+a_sz;
-  idx=(int *)(work+work_sz);
-
-  /* avoid destroying A, B by copying them to a, x resp. */
-  for(i=0; i<m; ++i){ // B & 1st row of A
-    a[i]=A[i];
-    x[i]=B[i];
-  }
-  for(  ; i<a_sz; ++i) a[i]=A[i]; // copy A's remaining rows
-  /****
-  for(i=0; i<m; ++i){
-    for(j=0; j<m; ++j)
-      a[i*m+j]=A[i*m+j];
-    x[i]=B[i];
-  }
-  ****/
-
-  /* compute the LU decomposition of a row permutation of matrix a; the permutation itself is saved in idx[] */
-	for(i=0; i<m; ++i){
-		max=0.0;
-		for(j=0; j<m; ++j)
-			if((tmp=FABS(a[i*m+j]))>max)
-        max=tmp;
-		  if(max==0.0){
-        fprintf(stderr, RCAT("Singular matrix A in ", AX_EQ_B_LU) "()!\n");
-#ifndef LINSOLVERS_RETAIN_MEMORY
-        free(buf);
-#endif
-
-        return 0;
-      }
-		  work[i]=LM_CNST(1.0)/max;
-	}
-
-	for(j=0; j<m; ++j){
-		for(i=0; i<j; ++i){
-			sum=a[i*m+j];
-			for(k=0; k<i; ++k)
-        sum-=a[i*m+k]*a[k*m+j];
-			a[i*m+j]=sum;
-		}
-		max=0.0;
-		for(i=j; i<m; ++i){
-			sum=a[i*m+j];
-			for(k=0; k<j; ++k)
-        sum-=a[i*m+k]*a[k*m+j];
-			a[i*m+j]=sum;
-			if((tmp=work[i]*FABS(sum))>=max){
-				max=tmp;
-				maxi=i;
-			}
-		}
-		if(j!=maxi){
-			for(k=0; k<m; ++k){
-				tmp=a[maxi*m+k];
-				a[maxi*m+k]=a[j*m+k];
-				a[j*m+k]=tmp;
-			}
-			work[maxi]=work[j];
-		}
-		idx[j]=maxi;
-		if(a[j*m+j]==0.0)
-      a[j*m+j]=LM_REAL_EPSILON;
-		if(j!=m-1){
-			tmp=LM_CNST(1.0)/(a[j*m+j]);
-			for(i=j+1; i<m; ++i)
-        a[i*m+j]*=tmp;
-		}
-	}
-
-  /* The decomposition has now replaced a. Solve the linear system using
-   * forward and back substitution
-   */
-	for(i=k=0; i<m; ++i){
-		j=idx[i];
-		sum=x[j];
-		x[j]=x[i];
-		if(k!=0)
-			for(j=k-1; j<i; ++j)
-        sum-=a[i*m+j]*x[j];
-		else
-      if(sum!=0.0)
-			  k=i+1;
-		x[i]=sum;
-	}
-
-	for(i=m-1; i>=0; --i){
-		sum=x[i];
-		for(j=i+1; j<m; ++j)
-      sum-=a[i*m+j]*x[j];
-		x[i]=sum/a[i*m+i];
-	}
+  ret=AX_EQ_B_LU_BUF(A, B, x, m, buf);
 
 #ifndef LINSOLVERS_RETAIN_MEMORY
   free(buf);
 #endif
 
-  return 1;
+  return ret;
 }
 
 /* undefine all. IT MUST REMAIN IN THIS POSITION IN FILE */
 #undef AX_EQ_B_LU
 
 #endif /* HAVE_LAPACK */
+
+#undef AX_EQ_B_LU_BUF
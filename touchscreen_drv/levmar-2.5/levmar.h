@@ -84,6 +84,26 @@ extern "C" {
 #define LM_BLEIC_DER_WORKSZ(npar, nmeas, nconstr1, nconstr2) LM_BLEC_DER_WORKSZ((npar)+(nconstr2), (nmeas)+(nconstr2), (nconstr1)+(nconstr2))
 #define LM_BLEIC_DIF_WORKSZ(npar, nmeas, nconstr1, nconstr2) LM_BLEC_DIF_WORKSZ((npar)+(nconstr2), (nmeas)+(nconstr2), (nconstr1)+(nconstr2))
 
+/* scratch memory size in bytes of the LU linear solver, for an npar x npar system
+ * of reals that are real_sz bytes each
+ */
+#define LM_LU_WORKSZ(npar, real_sz) (((npar)*(npar) + (npar))*(real_sz) + (npar)*sizeof(int))
+
+/* scratch memory owned by the caller of ?levmar_der_ctx(). Unlike the retained
+ * memory of the linear solvers, nothing in here is shared, so minimizations
+ * using different contexts can run at the same time in different threads.
+ * A context must be zeroed before its first use; buffers are grown as needed
+ * and kept for the following calls until levmar_ctx_free() is called.
+ */
+struct levmar_ctx {
+  void *work;     /* LM_DER_WORKSZ() reals */
+  int work_sz;    /* bytes */
+  void *lsbuf;    /* linear solver scratch, LM_LU_WORKSZ() bytes */
+  int lsbuf_sz;   /* bytes */
+};
+
+extern void levmar_ctx_free(struct levmar_ctx *ctx);
+
 #define LM_OPTS_SZ    	 5 /* max(4, 5) */
 #define LM_INFO_SZ    	 10
 #define LM_ERROR         -1
@@ -106,6 +126,13 @@ extern int dlevmar_dif(
       double *p, double *x, int m, int n, int itmax, double *opts,
       double *info, double *work, double *covar, void *adata);
 
+/* reentrant version of dlevmar_der() taking all scratch memory from ctx */
+extern int dlevmar_der_ctx(struct levmar_ctx *ctx,
+      void (*func)(double *p, double *hx, int m, int n, void *adata),
+      void (*jacf)(double *p, double *j, int m, int n, void *adata),
+      double *p, double *x, int m, int n, int itmax, double *opts,
+      double *info, double *covar, void *adata);
+
 /* box-constrained minimization */
 extern int dlevmar_bc_der(
        void (*func)(double *p, double *hx, int m, int n, void *adata),
@@ -211,6 +238,13 @@ extern int slevmar_dif(
       float *p, float *x, int m, int n, int itmax, float *opts,
       float *info, float *work, float *covar, void *adata);
 
+/* reentrant version of slevmar_der() taking all scratch memory from ctx */
+extern int slevmar_der_ctx(struct levmar_ctx *ctx,
+      void (*func)(float *p, float *hx, int m, int n, void *adata),
+      void (*jacf)(float *p, float *j, int m, int n, void *adata),
+      float *p, float *x, int m, int n, int itmax, float *opts,
+      float *info, float *covar, void *adata);
+
 /* box-constrained minimization */
 extern int slevmar_bc_der(
        void (*func)(float *p, float *hx, int m, int n, void *adata),
@@ -334,6 +368,15 @@ extern int sAx_eq_b_LU_noLapack(float *A, float *B, float *x, int n);
 
 #endif /* HAVE_LAPACK */
 
+/* LU solver working in caller supplied scratch memory of LM_LU_WORKSZ() bytes */
+#ifdef LM_DBL_PREC
+extern int dAx_eq_b_LU_buf(double *A, double *B, double *x, int m, void *buf);
+#endif /* LM_DBL_PREC */
+
+#ifdef LM_SNGL_PREC
+extern int sAx_eq_b_LU_buf(float *A, float *B, float *x, int m, void *buf);
+#endif /* LM_SNGL_PREC */
+
 /* Jacobian verification, double & single precision */
 #ifdef LM_DBL_PREC
 extern void dlevmar_chkjac(
@@ -39,6 +39,28 @@
 #error At least one of LM_DBL_PREC, LM_SNGL_PREC should be defined!
 #endif
 
+/* makes *buf at least sz bytes large, keeping it if it already is.
+ * Returns 0 if memory could not be allocated
+ */
+static int levmar_ctx_grow(void **buf, int *buf_sz, int sz)
+{
+  if(*buf_sz>=sz) return 1;
+
+  free(*buf);
+  *buf=malloc(sz);
+  *buf_sz=*buf ? sz : 0;
+
+  return *buf!=NULL;
+}
+
+void levmar_ctx_free(struct levmar_ctx *ctx)
+{
+  free(ctx->work);
+  free(ctx->lsbuf);
+  ctx->work=ctx->lsbuf=NULL;
+  ctx->work_sz=ctx->lsbuf_sz=0;
+}
+
 
 #ifdef LM_SNGL_PREC
 /* single precision (float) definitions */
@@ -24,6 +24,8 @@
 
 /* precision-specific definitions */
 #define LEVMAR_DER LM_ADD_PREFIX(levmar_der)
+#define LEVMAR_DER_CTX LM_ADD_PREFIX(levmar_der_ctx)
+#define LEVMAR_DER_CORE LM_ADD_PREFIX(levmar_der_core)
 #define LEVMAR_DIF LM_ADD_PREFIX(levmar_dif)
 #define LEVMAR_FDIF_FORW_JAC_APPROX LM_ADD_PREFIX(levmar_fdif_forw_jac_approx)
 #define LEVMAR_FDIF_CENT_JAC_APPROX LM_ADD_PREFIX(levmar_fdif_cent_jac_approx)
@@ -41,6 +43,7 @@
 #else
 #define AX_EQ_B_LU LM_ADD_PREFIX(Ax_eq_b_LU_noLapack)
 #endif /* HAVE_LAPACK */
+#define AX_EQ_B_LU_BUF LM_ADD_PREFIX(Ax_eq_b_LU_buf)
 
 /* 
  * This function seeks the parameter vector p that best describes the measurements vector x.
@@ -57,7 +60,7 @@
  * non-linear least squares at http://www.imm.dtu.dk/pubdb/views/edoc_download.php/3215/pdf/imm3215.pdf
  */
 
-int LEVMAR_DER(
+static int LEVMAR_DER_CORE(
   void (*func)(LM_REAL *p, LM_REAL *hx, int m, int n, void *adata), /* functional relation describing measurements. A p \in R^m yields a \hat{x} \in  R^n */
   void (*jacf)(LM_REAL *p, LM_REAL *j, int m, int n, void *adata),  /* function to evaluate the Jacobian \part x / \part p */ 
   LM_REAL *p,         /* I/O: initial parameter estimates. On output has the estimated solution */
@@ -86,9 +89,12 @@ int LEVMAR_DER(
                       */
   LM_REAL *work,     /* working memory at least LM_DER_WORKSZ() reals large, allocated if NULL */
   LM_REAL *covar,    /* O: Covariance matrix corresponding to LS solution; mxm. Set to NULL if not needed. */
-  void *adata)       /* pointer to possibly additional data, passed uninterpreted to func & jacf.
+  void *adata,       /* pointer to possibly additional data, passed uninterpreted to func & jacf.
                       * Set to NULL if not needed
                       */
+  void *lsbuf)       /* scratch memory of the linear solver, at least LM_LU_WORKSZ() bytes.
+                      * NULL to use the solver retaining its own memory
+                      */
 {
 register int i, j, k, l;
 int worksz, freework=0, issolved;
@@ -293,6 +299,11 @@ if(!(k%100)){
         jacTjac[i*m+i]+=mu;
 
       /* solve augmented equations */
+      if(lsbuf){
+        /* caller supplied scratch, nothing is retained between calls */
+        issolved=AX_EQ_B_LU_BUF(jacTjac, jacTe, Dp, m, lsbuf); ++nlss;
+      }
+      else{
 #ifdef HAVE_LAPACK
       /* 6 alternatives are available: LU, Cholesky, 2 variants of QR decomposition, SVD and LDLt.
        * Cholesky is the fastest but might be inaccurate; QR is slower but more accurate;
@@ -310,6 +321,7 @@ if(!(k%100)){
       /* use the LU included with levmar */
       issolved=AX_EQ_B_LU(jacTjac, jacTe, Dp, m); ++nlss; linsolver=AX_EQ_B_LU;
 #endif /* HAVE_LAPACK */
+      }
 
       if(issolved){
         /* compute p's new estimate and ||Dp||^2 */
@@ -422,6 +434,36 @@ if(!(k%100)){
   return (stop!=4 && stop!=7)?  k : LM_ERROR;
 }
 
+int LEVMAR_DER(
+  void (*func)(LM_REAL *p, LM_REAL *hx, int m, int n, void *adata),
+  void (*jacf)(LM_REAL *p, LM_REAL *j, int m, int n, void *adata),
+  LM_REAL *p, LM_REAL *x, int m, int n, int itmax, LM_REAL *opts,
+  LM_REAL *info, LM_REAL *work, LM_REAL *covar, void *adata)
+{
+  return LEVMAR_DER_CORE(func, jacf, p, x, m, n, itmax, opts, info, work, covar, adata, NULL);
+}
+
+/* Reentrant version of LEVMAR_DER() above: the work arrays and the memory of
+ * the linear solver come from ctx, which is grown when it is too small for
+ * the problem. Once ctx has been used for a problem of the same size, no
+ * memory is allocated (unless covar is requested) and no static data is used.
+ */
+int LEVMAR_DER_CTX(
+  struct levmar_ctx *ctx, /* I/O: scratch memory, zeroed before its first use */
+  void (*func)(LM_REAL *p, LM_REAL *hx, int m, int n, void *adata),
+  void (*jacf)(LM_REAL *p, LM_REAL *j, int m, int n, void *adata),
+  LM_REAL *p, LM_REAL *x, int m, int n, int itmax, LM_REAL *opts,
+  LM_REAL *info, LM_REAL *covar, void *adata)
+{
+  if(!levmar_ctx_grow(&ctx->work, &ctx->work_sz, LM_DER_WORKSZ(m, n)*sizeof(LM_REAL)) ||
+     !levmar_ctx_grow(&ctx->lsbuf, &ctx->lsbuf_sz, LM_LU_WORKSZ(m, sizeof(LM_REAL)))){
+    fprintf(stderr, LCAT(LEVMAR_DER_CTX, "(): memory allocation request failed\n"));
+    return LM_ERROR;
+  }
+
+  return LEVMAR_DER_CORE(func, jacf, p, x, m, n, itmax, opts, info, (LM_REAL *)ctx->work, covar, adata, ctx->lsbuf);
+}
+
 
 /* Secant version of the LEVMAR_DER() function above: the Jacobian is approximated with 
  * the aid of finite differences (forward or central, see the comment for the opts argument)
@@ -829,6 +871,8 @@ if(!(k%100)){
 
 /* undefine everything. THIS MUST REMAIN AT THE END OF THE FILE */
 #undef LEVMAR_DER
+#undef LEVMAR_DER_CTX
+#undef LEVMAR_DER_CORE
 #undef LEVMAR_DIF
 #undef LEVMAR_FDIF_FORW_JAC_APPROX
 #undef LEVMAR_FDIF_CENT_JAC_APPROX
@@ -836,6 +880,7 @@ if(!(k%100)){
 #undef LEVMAR_TRANS_MAT_MAT_MULT
 #undef LEVMAR_L2NRMXMY
 #undef AX_EQ_B_LU
+#undef AX_EQ_B_LU_BUF
 #undef AX_EQ_B_CHOL
 #undef AX_EQ_B_QR
 #undef AX_EQ_B_QRLS
@@ -28,81 +28,75 @@
 #include <math.h>
 #include <float.h>
 
-#include "levmar.h"2
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+
+#include "levmar.h"
+#include "lmdemo.h"
 
-#define SD .76
+#define SD FIT_SD
 
 #ifndef LM_DBL_PREC
 #error Demo program assumes that levmar has been compiled with double precision, see LM_DBL_PREC!
 #endif
-void gaussian_fit5(double *p, double *x, int m, int n, void *data)
+// Evaluates the model at p over a size x size window into x and its
+// Jacobian into jac, either can be NULL. The exponential of a point is the
+// product of an exponential of its row and one of its column, so only
+// 2 * size exponentials are needed.
+static void gaussian_model(int size, double *p, double *x, double *jac)
 {
-	int j, k;
-	int t[5];
-	t[0] = -2;
-	t[1] = -1;
-	t[2] = 0;
-	t[3] = 1;
-	t[4] = 2;
-	for(j=0; j<5; ++j)
-		for(k=0; k<5; ++k) {
-			x[j*5+k]=p[0]*exp(-((t[j]-p[1])*(t[j]-p[1]) + (t[k]-p[2])*(t[k]-p[2]))/(2*SD*SD));
+	double ej[FIT_MAX_SIZE], ek[FIT_MAX_SIZE], dj[FIT_MAX_SIZE], dk[FIT_MAX_SIZE];
+	double g;
+	int j, k, l = 0;
+
+	for(j=0; j<size; ++j) {
+		dj[j] = j - size/2 - p[1];
+		dk[j] = j - size/2 - p[2];
+		ej[j] = exp(-dj[j]*dj[j]/(2*SD*SD));
+		ek[j] = exp(-dk[j]*dk[j]/(2*SD*SD));
+	}
+	for(j=0; j<size; ++j)
+		for(k=0; k<size; ++k) {
+			g = ej[j]*ek[k];
+			if(x)
+				x[j*size+k] = p[0]*g;
+			if(jac) {
+				jac[l++] = g;
+				jac[l++] = p[0]*g*dj[j]/(SD*SD);
+				jac[l++] = p[0]*g*dk[k]/(SD*SD);
+			}
 		}
-} 
+}
+
+// The levmar callbacks for each window size. m and n are fixed by the size
+// and there is no extra data.
+void gaussian_fit5(double *p, double *x, int m, int n, void *data)
+{
+	(void)m; (void)n; (void)data;
+	gaussian_model(5, p, x, NULL);
+}
 
 void gaussian_fit3(double *p, double *x, int m, int n, void *data)
 {
-	int j, k;
-	int t[3];
-	t[0] = -1;
-	t[1] = 0;
-	t[2] = 1;
-	for(j=0; j<3; ++j)
-		for(k=0; k<3; ++k) {
-			x[j*3+k]=p[0]*exp(-((t[j]-p[1])*(t[j]-p[1]) + (t[k]-p[2])*(t[k]-p[2]))/(2*SD*SD));
-		}
-} 
+	(void)m; (void)n; (void)data;
+	gaussian_model(3, p, x, NULL);
+}
 
 void jac_gaussian_fit5(double *p, double *jac, int m, int n, void *data)
 {
-	int l;
-	int j, k;
-	int t[5];
-	t[0] = -2;
-	t[1] = -1;
-	t[2] = 0;
-	t[3] = 1;
-	t[4] = 2;
-	for(j=0; j<5; ++j)
-		for(k=0; k<5; ++k) {
-			jac[l++]=exp(-((t[j]-p[1])*(t[j]-p[1]) + (t[k]-p[2])*(t[k]-p[2]))/(2*SD*SD));
-			jac[l++]=p[0]*exp(-((t[j]-p[1])*(t[j]-p[1]) + (t[k]-p[2])*(t[k]-p[2]))/(2*SD*SD))*2*(t[j]-p[1])/(2*SD*SD);
-			jac[l++]=p[0]*exp(-((t[j]-p[1])*(t[j]-p[1]) + (t[k]-p[2])*(t[k]-p[2]))/(2*SD*SD))*2*(t[k]-p[2])/(2*SD*SD);
-		//	jac[l++]=p[0]*exp(-((t[j]-p[1])*(t[j]-p[1]) + (t[k]-p[2])*(t[k]-p[2]))/(2*SD*SD))*(((t[j]-p[1])*(t[j]-p[1]) + (t[k]-p[2])*(
-		}
-} 
+	(void)m; (void)n; (void)data;
+	gaussian_model(5, p, NULL, jac);
+}
 
 void jac_gaussian_fit3(double *p, double *jac, int m, int n, void *data)
 {
-	int l;
-	int j, k;
-	int t[3];
-	t[0] = -1;
-	t[1] = 0;
-	t[2] = 1;
-	for(j=0; j<3; ++j)
-		for(k=0; k<3; ++k) {
-			jac[l++]=exp(-((t[j]-p[1])*(t[j]-p[1]) + (t[k]-p[2])*(t[k]-p[2]))/(2*SD*SD));
-			jac[l++]=p[0]*exp(-((t[j]-p[1])*(t[j]-p[1]) + (t[k]-p[2])*(t[k]-p[2]))/(2*SD*SD))*2*(t[j]-p[1])/(2*SD*SD);
-			jac[l++]=p[0]*exp(-((t[j]-p[1])*(t[j]-p[1]) + (t[k]-p[2])*(t[k]-p[2]))/(2*SD*SD))*2*(t[k]-p[2])/(2*SD*SD);
-		//	jac[l++]=p[0]*exp(-((t[j]-p[1])*(t[j]-p[1]) + (t[k]-p[2])*(t[k]-p[2]))/(2*SD*SD))*(((t[j]-p[1])*(t[j]-p[1]) + (t[k]-p[2])*(
-		}
-} 
+	(void)m; (void)n; (void)data;
+	gaussian_model(3, p, NULL, jac);
+}
 
-int runlm(int radius, double *p, double *x, double *r)
+int runlm(struct levmar_ctx *ctx, int radius, double *p, double *x, double *r)
 {
-register int i, j;
-int problem, ret;
 int m, n;
 double opts[LM_OPTS_SZ], info[LM_INFO_SZ];
 
@@ -116,14 +110,352 @@ double opts[LM_OPTS_SZ], info[LM_INFO_SZ];
   if(radius == 2)
   {
  	n=25;
-  	ret=dlevmar_der(gaussian_fit5, jac_gaussian_fit5, p, x, m, n, 500, opts, info, NULL, NULL, NULL);	
+  	if(ctx)
+  	  dlevmar_der_ctx(ctx, gaussian_fit5, jac_gaussian_fit5, p, x, m, n, 500, opts, info, NULL, NULL);
+  	else
+  	  dlevmar_der(gaussian_fit5, jac_gaussian_fit5, p, x, m, n, 500, opts, info, NULL, NULL, NULL);
   }
   if(radius == 1)
   {
  	n=9;
-  	ret=dlevmar_der(gaussian_fit3, jac_gaussian_fit3, p, x, m, n, 500, opts, info, NULL, NULL, NULL);	
+  	if(ctx)
+  	  dlevmar_der_ctx(ctx, gaussian_fit3, jac_gaussian_fit3, p, x, m, n, 500, opts, info, NULL, NULL);
+  	else
+  	  dlevmar_der(gaussian_fit3, jac_gaussian_fit3, p, x, m, n, 500, opts, info, NULL, NULL, NULL);
   }
 
   r[0] = p[1]; r[1] = p[2];
-  return 0;
+  return (int)info[5];
+}
+
+// Residuals, exponential terms and offsets of each point of the window
+// for the fixed size fit. The points are padded with zeros to whole NEON
+// vectors.
+#define FIT_PADDED ((FIT_MAX_SIZE*FIT_MAX_SIZE + 3) & ~3)
+struct fit_terms {
+	float r[FIT_PADDED];
+	float g[FIT_PADDED];
+	float dj[FIT_PADDED];
+	float dk[FIT_PADDED];
+};
+
+// Sets up the terms of the model p against x and returns the squared
+// error. x has to be padded like the terms.
+static float fit_error(int radius, const float *p, const float *x,
+	struct fit_terms *t)
+{
+	float ej[FIT_MAX_SIZE], ek[FIT_MAX_SIZE], dj[FIT_MAX_SIZE], dk[FIT_MAX_SIZE];
+	int j, k, n = 0, size = 2*radius + 1;
+	float err = 0;
+
+	for(j=0; j<size; ++j) {
+		dj[j] = j - radius - p[1];
+		dk[j] = j - radius - p[2];
+		ej[j] = expf(-dj[j]*dj[j] * (float)(1 / (2*SD*SD)));
+		ek[j] = expf(-dk[j]*dk[j] * (float)(1 / (2*SD*SD)));
+	}
+	for(j=0; j<size; ++j)
+		for(k=0; k<size; ++k) {
+			t->g[n] = ej[j]*ek[k];
+			t->dj[n] = dj[j];
+			t->dk[n] = dk[k];
+			t->r[n] = x[n] - p[0]*t->g[n];
+			err += t->r[n]*t->r[n];
+			n++;
+		}
+	for(; n & 3; ++n)
+		t->r[n] = t->g[n] = t->dj[n] = t->dk[n] = 0;
+	return err;
+}
+
+// Builds the normal equations J^T J (upper triangle, row by row) and
+// J^T e from the terms of p
+static void fit_normal(int radius, const float *p, const struct fit_terms *t,
+	float *jtj, float *jte)
+{
+	int n, count = ((2*radius + 1)*(2*radius + 1) + 3) & ~3;
+	float c = p[0] * (float)(1 / (SD*SD));
+#ifdef __ARM_NEON__
+	float32x4_t s00, s01, s02, s11, s12, s22, s0, s1, s2, d0, d1, d2, r;
+	float32x2_t sum[9];
+
+	s00 = s01 = s02 = s11 = s12 = s22 = s0 = s1 = s2 = vdupq_n_f32(0);
+	for(n=0; n<count; n+=4) {
+		d0 = vld1q_f32(&t->g[n]);
+		r = vld1q_f32(&t->r[n]);
+		d2 = vmulq_n_f32(d0, c);
+		d1 = vmulq_f32(d2, vld1q_f32(&t->dj[n]));
+		d2 = vmulq_f32(d2, vld1q_f32(&t->dk[n]));
+		s00 = vmlaq_f32(s00, d0, d0);
+		s01 = vmlaq_f32(s01, d0, d1);
+		s02 = vmlaq_f32(s02, d0, d2);
+		s11 = vmlaq_f32(s11, d1, d1);
+		s12 = vmlaq_f32(s12, d1, d2);
+		s22 = vmlaq_f32(s22, d2, d2);
+		s0 = vmlaq_f32(s0, d0, r);
+		s1 = vmlaq_f32(s1, d1, r);
+		s2 = vmlaq_f32(s2, d2, r);
+	}
+	sum[0] = vadd_f32(vget_low_f32(s00), vget_high_f32(s00));
+	sum[1] = vadd_f32(vget_low_f32(s01), vget_high_f32(s01));
+	sum[2] = vadd_f32(vget_low_f32(s02), vget_high_f32(s02));
+	sum[3] = vadd_f32(vget_low_f32(s11), vget_high_f32(s11));
+	sum[4] = vadd_f32(vget_low_f32(s12), vget_high_f32(s12));
+	sum[5] = vadd_f32(vget_low_f32(s22), vget_high_f32(s22));
+	sum[6] = vadd_f32(vget_low_f32(s0), vget_high_f32(s0));
+	sum[7] = vadd_f32(vget_low_f32(s1), vget_high_f32(s1));
+	sum[8] = vadd_f32(vget_low_f32(s2), vget_high_f32(s2));
+	for(n=0; n<6; ++n)
+		jtj[n] = vget_lane_f32(vpadd_f32(sum[n], sum[n]), 0);
+	for(n=0; n<3; ++n)
+		jte[n] = vget_lane_f32(vpadd_f32(sum[n+6], sum[n+6]), 0);
+#else
+	float d0, d1, d2, r;
+
+	for(n=0; n<6; ++n)
+		jtj[n] = 0;
+	jte[0] = jte[1] = jte[2] = 0;
+	for(n=0; n<count; ++n) {
+		d0 = t->g[n];
+		d1 = c*d0*t->dj[n];
+		d2 = c*d0*t->dk[n];
+		r = t->r[n];
+		jtj[0] += d0*d0; jtj[1] += d0*d1; jtj[2] += d0*d2;
+		jtj[3] += d1*d1; jtj[4] += d1*d2; jtj[5] += d2*d2;
+		jte[0] += d0*r; jte[1] += d1*r; jte[2] += d2*r;
+	}
+#endif
+}
+
+// Solves (J^T J + mu I) step = J^T e with the adjugate of the 3x3 matrix,
+// returns 0 if it is singular
+static int fit_solve(const float *jtj, const float *jte, float mu, float *step)
+{
+	float a = jtj[0] + mu, b = jtj[1], c = jtj[2];
+	float d = jtj[3] + mu, e = jtj[4], f = jtj[5] + mu;
+	float c0 = d*f - e*e, c1 = c*e - b*f, c2 = b*e - c*d;
+	float det = a*c0 + b*c1 + c*c2;
+
+	if(!(det > 0))
+		return 0;
+	step[0] = (c0*jte[0] + c1*jte[1] + c2*jte[2]) / det;
+	step[1] = (c1*jte[0] + (a*f - c*c)*jte[1] + (b*c - a*e)*jte[2]) / det;
+	step[2] = (c2*jte[0] + (b*c - a*e)*jte[1] + (a*d - b*b)*jte[2]) / det;
+	return 1;
+}
+
+int fit_gaussian(int radius, float *p, const float *x)
+{
+	struct fit_terms terms[2], *t = &terms[0], *trial_t = &terms[1], *swap;
+	float padded[FIT_PADDED];
+	float jtj[6], jte[3], step[3], trial[3];
+	float err, trial_err, mu, nu = 2, gain, rho;
+	int i, it, n = (2*radius + 1)*(2*radius + 1);
+
+	for(i=0; i<n; ++i)
+		padded[i] = x[i];
+	for(; i & 3; ++i)
+		padded[i] = 0;
+	err = fit_error(radius, p, padded, t);
+	fit_normal(radius, p, t, jtj, jte);
+	// Same starting damping as levmar, relative to the largest diagonal
+	mu = LM_INIT_MU * fmaxf(jtj[0], fmaxf(jtj[3], jtj[5]));
+
+	for(it=1; it<=FIT_MAX_ITERATIONS; ++it) {
+		if(!fit_solve(jtj, jte, mu, step)) {
+			mu *= nu; nu *= 2;
+			continue;
+		}
+		for(i=0; i<3; ++i)
+			trial[i] = p[i] + step[i];
+		trial_err = fit_error(radius, trial, padded, trial_t);
+		// Drop in error that the linear model expected
+		gain = step[0]*(mu*step[0] + jte[0]) + step[1]*(mu*step[1] + jte[1]) +
+			step[2]*(mu*step[2] + jte[2]);
+		if(trial_err < err && gain > 0) {
+			rho = (err - trial_err) / gain;
+			rho = 2*rho - 1;
+			mu *= fmaxf(1.0f/3, 1 - rho*rho*rho);
+			nu = 2;
+			for(i=0; i<3; ++i)
+				p[i] = trial[i];
+			swap = t; t = trial_t; trial_t = swap;
+			err = trial_err;
+			if(fabsf(step[1]) < FIT_MIN_STEP && fabsf(step[2]) < FIT_MIN_STEP)
+				break;
+			fit_normal(radius, p, t, jtj, jte);
+		} else {
+			mu *= nu; nu *= 2;
+		}
+	}
+	return it > FIT_MAX_ITERATIONS ? FIT_MAX_ITERATIONS : it;
+}
+
+#define JOINT_PARAMS (3*FIT_MAX_GAUSSIANS)
+#define JOINT_POINTS ((FIT_JOINT_MAX_SIZE*FIT_JOINT_MAX_SIZE + 3) & ~3)
+
+// Exponentials of each Gaussian of the joint fit over the rows and the
+// columns of the window, and the residuals of each point
+struct joint_terms {
+	float ej[FIT_MAX_GAUSSIANS][FIT_JOINT_MAX_SIZE];
+	float ek[FIT_MAX_GAUSSIANS][FIT_JOINT_MAX_SIZE];
+	float r[JOINT_POINTS];
+};
+
+// Sets up the terms of the model p against x and returns the squared error
+static float joint_error(int count, int rows, int cols, const float *p,
+	const float *x, struct joint_terms *t)
+{
+	int c, j, k, n = 0;
+	float d, model, err = 0;
+
+	for(c=0; c<count; ++c) {
+		for(j=0; j<rows; ++j) {
+			d = j - p[3*c+1];
+			t->ej[c][j] = expf(-d*d * (float)(1 / (2*SD*SD)));
+		}
+		for(k=0; k<cols; ++k) {
+			d = k - p[3*c+2];
+			t->ek[c][k] = expf(-d*d * (float)(1 / (2*SD*SD)));
+		}
+	}
+	for(j=0; j<rows; ++j)
+		for(k=0; k<cols; ++k) {
+			model = 0;
+			for(c=0; c<count; ++c)
+				model += p[3*c]*t->ej[c][j]*t->ek[c][k];
+			t->r[n] = x[n] - model;
+			err += t->r[n]*t->r[n];
+			n++;
+		}
+	for(; n & 3; ++n)
+		t->r[n] = 0;
+	return err;
+}
+
+// Dot product of two rows of n values, padded with zeros to a multiple
+// of 4. Four sums are kept so that they don't wait on each other.
+static float joint_dot(const float *x, const float *y, int n)
+{
+	float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+	int i;
+
+	for(i=0; i<n; i+=4) {
+		s0 += x[i]*y[i];
+		s1 += x[i+1]*y[i+1];
+		s2 += x[i+2]*y[i+2];
+		s3 += x[i+3]*y[i+3];
+	}
+	return (s0 + s1) + (s2 + s3);
+}
+
+// Builds the normal equations J^T J (all of it, row by row) and J^T e
+// from the terms of p. The Jacobian is stored a column at a time so that
+// each sum runs along a row of it.
+static void joint_normal(int count, int rows, int cols, const float *p,
+	const struct joint_terms *t, float *jtj, float *jte)
+{
+	float jac[JOINT_PARAMS][JOINT_POINTS], g;
+	int m = 3*count, points = rows*cols, a, b, c, j, k, n;
+
+	for(c=0; c<count; ++c)
+		for(j=0, n=0; j<rows; ++j)
+			for(k=0; k<cols; ++k, ++n) {
+				g = t->ej[c][j]*t->ek[c][k];
+				jac[3*c][n] = g;
+				jac[3*c+1][n] = p[3*c]*g*(j - p[3*c+1]) * (float)(1 / (SD*SD));
+				jac[3*c+2][n] = p[3*c]*g*(k - p[3*c+2]) * (float)(1 / (SD*SD));
+			}
+	for(a=0; a<m; ++a)
+		for(n=points; n & 3; ++n)
+			jac[a][n] = 0;
+	for(a=0; a<m; ++a) {
+		for(b=a; b<m; ++b)
+			jtj[a*m+b] = jtj[b*m+a] = joint_dot(jac[a], jac[b], points);
+		jte[a] = joint_dot(jac[a], t->r, points);
+	}
+}
+
+// Solves (J^T J + mu I) step = J^T e for m parameters with the Cholesky
+// decomposition, returns 0 if the matrix isn't positive definite
+static int joint_solve(int m, const float *jtj, const float *jte, float mu,
+	float *step)
+{
+	float l[JOINT_PARAMS*JOINT_PARAMS], sum;
+	int i, j, k;
+
+	for(i=0; i<m; ++i)
+		for(j=0; j<=i; ++j) {
+			sum = jtj[i*m+j] + (i == j ? mu : 0);
+			for(k=0; k<j; ++k)
+				sum -= l[i*m+k]*l[j*m+k];
+			if(i == j) {
+				if(!(sum > 0))
+					return 0;
+				l[i*m+i] = sqrtf(sum);
+			} else
+				l[i*m+j] = sum / l[j*m+j];
+		}
+	// L y = J^T e, then L^T step = y
+	for(i=0; i<m; ++i) {
+		sum = jte[i];
+		for(k=0; k<i; ++k)
+			sum -= l[i*m+k]*step[k];
+		step[i] = sum / l[i*m+i];
+	}
+	for(i=m-1; i>=0; --i) {
+		sum = step[i];
+		for(k=i+1; k<m; ++k)
+			sum -= l[k*m+i]*step[k];
+		step[i] = sum / l[i*m+i];
+	}
+	return 1;
+}
+
+int fit_gaussians(int count, int rows, int cols, float *p, const float *x)
+{
+	struct joint_terms terms[2], *t = &terms[0], *trial_t = &terms[1], *swap;
+	float jtj[JOINT_PARAMS*JOINT_PARAMS];
+	float jte[JOINT_PARAMS], step[JOINT_PARAMS], trial[JOINT_PARAMS];
+	float err, trial_err, mu = 0, nu = 2, gain, rho, largest;
+	int i, it, c, m = 3*count;
+
+	err = joint_error(count, rows, cols, p, x, t);
+	joint_normal(count, rows, cols, p, t, jtj, jte);
+	for(i=0; i<m; ++i)
+		mu = fmaxf(mu, jtj[i*m+i]);
+	mu *= LM_INIT_MU;
+
+	for(it=1; it<=FIT_JOINT_MAX_ITERATIONS; ++it) {
+		if(!joint_solve(m, jtj, jte, mu, step)) {
+			mu *= nu; nu *= 2;
+			continue;
+		}
+		gain = 0;
+		for(i=0; i<m; ++i) {
+			trial[i] = p[i] + step[i];
+			gain += step[i]*(mu*step[i] + jte[i]);
+		}
+		trial_err = joint_error(count, rows, cols, trial, x, trial_t);
+		if(trial_err < err && gain > 0) {
+			rho = (err - trial_err) / gain;
+			rho = 2*rho - 1;
+			mu *= fmaxf(1.0f/3, 1 - rho*rho*rho);
+			nu = 2;
+			for(i=0; i<m; ++i)
+				p[i] = trial[i];
+			swap = t; t = trial_t; trial_t = swap;
+			err = trial_err;
+			largest = 0;
+			for(c=0; c<count; ++c)
+				largest = fmaxf(largest, fmaxf(fabsf(step[3*c+1]),
+					fabsf(step[3*c+2])));
+			if(largest < FIT_MIN_STEP)
+				break;
+			joint_normal(count, rows, cols, p, t, jtj, jte);
+		} else {
+			mu *= nu; nu *= 2;
+		}
+	}
+	return it > FIT_JOINT_MAX_ITERATIONS ? FIT_JOINT_MAX_ITERATIONS : it;
 }
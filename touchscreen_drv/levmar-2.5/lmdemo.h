@@ -0,0 +1,58 @@
+/*
+ * Gaussian fits of the touch peaks for the HP Touchpad userspace
+ * touchscreen driver, see lmdemo.c.
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *
+ * Copyright (c) 2012 CyanogenMod Touchpad Project.
+ *
+ *
+ */
+
+// Model of a touch, a Gaussian with this standard deviation in points
+#define FIT_SD 0.76
+// Most points on a side of the fitted window
+#define FIT_MAX_SIZE 5
+// The fixed size fit gives up after this many iterations and stops once a
+// step moves the center by less than FIT_MIN_STEP points, about the 1/256
+// of a point that the driver keeps locations in
+#define FIT_MAX_ITERATIONS 10
+#define FIT_MIN_STEP 4E-3f
+
+// Fits p[0] * exp(-((i - p[1])^2 + (j - p[2])^2) / (2 * FIT_SD^2)) to the
+// (2 * radius + 1)^2 values in x, row by row, with i and j running from
+// -radius to radius. p holds the starting guess and is set to the result.
+// runlm() uses the general levmar solver and sets r to p[1], p[2]. It
+// works in the memory of ctx, so fits with different contexts can run at
+// the same time; with a NULL ctx levmar allocates its own for each fit.
+// fit_gaussian() is the same fit for radius 1 or 2 in float with all of
+// its work space on the stack. Both return the number of iterations.
+struct levmar_ctx;
+int runlm(struct levmar_ctx *ctx, int radius, double *p, double *x, double *r);
+int fit_gaussian(int radius, float *p, const float *x);
+
+// Most touches fitted together, and most points on a side of their window
+#define FIT_MAX_GAUSSIANS 3
+#define FIT_JOINT_MAX_SIZE 9
+#define FIT_JOINT_MAX_ITERATIONS 15
+
+// Fits the sum of count Gaussians like the one above to the rows x cols
+// values in x, row by row. p holds the height, row and column of each
+// Gaussian in turn, with rows and columns counted from the top left of
+// the window. Like fit_gaussian() it is done in float on the stack and
+// returns the number of iterations.
+int fit_gaussians(int count, int rows, int cols, float *p, const float *x);
@@ -0,0 +1,109 @@
+/*
+ * Shared memory tap of the frames processed by the HP Touchpad userspace
+ * touchscreen driver.  Tools get the shared memory fd from the control
+ * socket, map it and read the frames without slowing the driver down.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *
+ * Copyright (c) 2012 CyanogenMod Touchpad Project.
+ *
+ *
+ */
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "tap.h"
+
+int tap_subscribers;
+static int shared_fd = -1;
+static struct tap_header *header;
+static struct tap_frame *frames;
+
+static int create_shared_fd(void)
+{
+	int fd = -1;
+
+#ifdef __NR_memfd_create
+	fd = syscall(__NR_memfd_create, "ts_srv_tap", 0);
+#endif
+	if (fd < 0) {
+		fd = open(TAP_FALLBACK_PATH, O_RDWR | O_CREAT | O_TRUNC, 0600);
+		if (fd >= 0)
+			unlink(TAP_FALLBACK_PATH);
+	}
+	if (fd < 0) {
+		printf("Unable to create tap shared memory\n");
+		return -1;
+	}
+	if (ftruncate(fd, TAP_SIZE) < 0) {
+		printf("Unable to size tap shared memory\n");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int tap_fd(void)
+{
+	void *map;
+	int fd;
+
+	if (shared_fd >= 0)
+		return shared_fd;
+	fd = create_shared_fd();
+	if (fd < 0)
+		return -1;
+	map = mmap(NULL, TAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		printf("Unable to map tap shared memory\n");
+		close(fd);
+		return -1;
+	}
+	// The file starts out zeroed, so every seq is even and head is 0
+	header = map;
+	frames = (struct tap_frame *)(header + 1);
+	header->magic = TAP_MAGIC;
+	header->version = TAP_VERSION;
+	header->slots = TAP_SLOTS;
+	header->slot_size = sizeof(struct tap_frame);
+	shared_fd = fd;
+	return fd;
+}
+
+struct tap_frame *tap_begin(void)
+{
+	struct tap_frame *frame;
+
+	if (!header)
+		return NULL;
+	frame = &frames[header->head % TAP_SLOTS];
+	frame->seq++;
+	// Readers have to see the odd seq before any of the new data
+	__sync_synchronize();
+	return frame;
+}
+
+void tap_end(struct tap_frame *frame)
+{
+	__sync_synchronize();
+	frame->seq++;
+	__sync_synchronize();
+	header->head++;
+}
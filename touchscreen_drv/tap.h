@@ -0,0 +1,94 @@
+/*
+ * Shared memory tap of the frames processed by the HP Touchpad userspace
+ * touchscreen driver.  Tools get the shared memory fd from the control
+ * socket, map it and read the frames without slowing the driver down.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *
+ * Copyright (c) 2012 CyanogenMod Touchpad Project.
+ *
+ *
+ */
+
+// Layout of the shared memory: a struct tap_header followed by TAP_SLOTS
+// struct tap_frame. Frames are written to the slots in turn, head counts
+// the frames written so the newest frame is in slot (head - 1) % slots.
+//
+// Each slot is a seqlock. seq is odd while the driver writes the slot, so
+// a reader copies the slot out, checks that seq was even and did not
+// change while copying, and otherwise tries again.
+#define TAP_MAGIC 0x31504154 // "TAP1"
+#define TAP_VERSION 1
+#define TAP_SLOTS 16
+#define TAP_ROWS 30
+#define TAP_COLS 40
+#define TAP_MAX_TOUCH 10
+
+// Where the shared memory is created when the kernel has no memfd_create.
+// It is unlinked right away so only the fd passed over the socket is left.
+#define TAP_FALLBACK_PATH "/dev/ts_srv_tap"
+
+struct tap_header {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int slots;
+	unsigned int slot_size;
+	volatile unsigned int head;
+};
+
+// A touch area found in the matrix. i and j are the center in points with
+// 8 fractional bits.
+struct tap_blob {
+	int i;
+	int j;
+	int weight;
+	int highest_val;
+};
+
+// A touch as it was sent to the input system
+struct tap_touch {
+	int tracking_id;
+	int x;
+	int y;
+	int touch_major;
+};
+
+struct tap_frame {
+	volatile unsigned int seq;
+	unsigned int frame;
+	// CLOCK_MONOTONIC time of the uart read that completed the frame
+	long long read_ns;
+	unsigned char matrix[TAP_ROWS][TAP_COLS];
+	unsigned int blob_count;
+	struct tap_blob blobs[TAP_MAX_TOUCH];
+	unsigned int touch_count;
+	struct tap_touch touches[TAP_MAX_TOUCH];
+};
+
+#define TAP_SIZE (sizeof(struct tap_header) + \
+	TAP_SLOTS * sizeof(struct tap_frame))
+
+// Number of clients that have the tap, nothing is written while it is 0
+extern int tap_subscribers;
+
+// Returns the fd of the shared memory, creating it the first time, or -1
+int tap_fd(void);
+
+// The slot to write the next frame to, or NULL if there is no tap. The
+// frame is visible to readers after tap_end().
+struct tap_frame *tap_begin(void);
+
+void tap_end(struct tap_frame *frame);
@@ -0,0 +1,108 @@
+/*
+ * Latency and health counters for the HP Touchpad userspace touchscreen
+ * driver.  Counters are only ever added to with atomic operations so that
+ * any thread can update them and a snapshot can be taken without locks.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *
+ * Copyright (c) 2012 CyanogenMod Touchpad Project.
+ *
+ *
+ */
+
+#include <time.h>
+
+#include "telemetry.h"
+
+struct telemetry telemetry;
+// Start of the second that frames are being counted in for fps, in ms so
+// that other threads can read it in one go
+static volatile unsigned int second_start_ms, second_frames;
+
+long long telemetry_now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+void telemetry_count(unsigned int *counter)
+{
+	__sync_fetch_and_add(counter, 1);
+}
+
+void telemetry_frame(int touches)
+{
+	unsigned int now = telemetry_now_ns() / 1000000;
+
+	telemetry_count(&telemetry.frames);
+	if (touches >= TOUCH_BUCKETS)
+		touches = TOUCH_BUCKETS - 1;
+	telemetry_count(&telemetry.touches[touches]);
+
+	// Only the processing thread counts frames, so the second doesn't
+	// need to be atomic
+	second_frames++;
+	if (now - second_start_ms >= 1000) {
+		// After a gap the second being counted is long gone
+		telemetry.fps = now - second_start_ms < 2000 ? second_frames : 0;
+		second_start_ms = now;
+		second_frames = 0;
+	}
+}
+
+unsigned int telemetry_fps(void)
+{
+	// telemetry.fps is only worked out when a frame comes in, so it would
+	// keep the last rate forever once the digitizer goes quiet
+	unsigned int idle = telemetry_now_ns() / 1000000 - second_start_ms;
+
+	if (idle >= 2000)
+		return 0;
+	if (idle >= 1000)
+		return second_frames;
+	return telemetry.fps;
+}
+
+void telemetry_latency(long long ns)
+{
+	long long us = ns / 1000;
+	int bucket = 0;
+
+	while (us > 0 && bucket < LATENCY_BUCKETS - 1) {
+		us >>= 1;
+		bucket++;
+	}
+	telemetry_count(&telemetry.latency[bucket]);
+}
+
+unsigned int telemetry_latency_percentile(int percent)
+{
+	unsigned int total = 0, seen = 0;
+	int bucket;
+
+	for (bucket=0; bucket<LATENCY_BUCKETS; bucket++)
+		total += telemetry.latency[bucket];
+	if (!total)
+		return 0;
+	for (bucket=0; bucket<LATENCY_BUCKETS - 1; bucket++) {
+		seen += telemetry.latency[bucket];
+		if (seen * 100ULL >= (unsigned long long)total * percent)
+			break;
+	}
+	return 1U << bucket;
+}
@@ -0,0 +1,65 @@
+/*
+ * Latency and health counters for the HP Touchpad userspace touchscreen
+ * driver.  Counters are only ever added to with atomic operations so that
+ * any thread can update them and a snapshot can be taken without locks.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *
+ * Copyright (c) 2012 CyanogenMod Touchpad Project.
+ *
+ *
+ */
+
+// Latencies are counted in power of 2 buckets of microseconds. Bucket 0 is
+// below 1 us, bucket b is from 2^(b-1) up to 2^b us and the last bucket
+// holds everything longer.
+#define LATENCY_BUCKETS 24
+// Frames are counted by their number of touches, the last bucket holds
+// frames with that many touches or more
+#define TOUCH_BUCKETS 11
+
+struct telemetry {
+	// Time from the uart read that completed a frame to the write of its
+	// SYN_REPORT
+	unsigned int latency[LATENCY_BUCKETS];
+	unsigned int touches[TOUCH_BUCKETS];
+	unsigned int frames;
+	// Frames in the last full second
+	unsigned int fps;
+	// Touches that were lifted off because they moved too far
+	unsigned int max_delta_liftoffs;
+	// Lift offs because the uart went quiet
+	unsigned int timeout_liftoffs;
+	// Tracking IDs handed out to new touches
+	unsigned int new_tracking_ids;
+};
+
+extern struct telemetry telemetry;
+
+long long telemetry_now_ns(void);
+
+void telemetry_count(unsigned int *counter);
+
+void telemetry_frame(int touches);
+
+// Frames in the last full second, this is 0 once the frames stop
+unsigned int telemetry_fps(void);
+
+void telemetry_latency(long long ns);
+
+// Upper bound in us of the bucket that holds the given percentile of the
+// latencies, 0 if nothing was counted yet
+unsigned int telemetry_latency_percentile(int percent);
@@ -0,0 +1,159 @@
+/*
+ * Record and replay support for the HP Touchpad userspace touchscreen
+ * driver.  Raw UART data is stored along with the time between reads so
+ * that recorded gestures can be fed back through the driver later.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *
+ * Copyright (c) 2012 CyanogenMod Touchpad Project.
+ *
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "trace.h"
+
+static int trace_fd = -1;
+// Capture data is buffered so that the RT loop only hits the disk once
+// every TRACE_BUF_SIZE bytes.
+static unsigned char trace_buf[TRACE_BUF_SIZE];
+static int trace_len;
+static struct timespec last_ts;
+
+static void put_le(unsigned char *dest, unsigned int value, int bytes)
+{
+	int i;
+	for (i=0; i<bytes; i++)
+		dest[i] = (value >> (8 * i)) & 0xFF;
+}
+
+static unsigned int get_le(const unsigned char *src, int bytes)
+{
+	unsigned int value = 0;
+	int i;
+	for (i=bytes - 1; i>=0; i--)
+		value = (value << 8) | src[i];
+	return value;
+}
+
+int trace_open_write(const char *path)
+{
+	trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (trace_fd < 0) {
+		printf("Unable to open trace file %s for writing\n", path);
+		return -1;
+	}
+	memcpy(trace_buf, TRACE_MAGIC, TRACE_MAGIC_LEN);
+	trace_len = TRACE_MAGIC_LEN;
+	last_ts.tv_sec = 0;
+	last_ts.tv_nsec = 0;
+	return 0;
+}
+
+void trace_flush(void)
+{
+	// Only async signal safe calls in here, this is also called when the
+	// driver is killed. That rules out printf for the error.
+	static const char error[] = "Error writing trace file\n";
+
+	if (trace_fd >= 0 && trace_len > 0) {
+		if (write(trace_fd, trace_buf, trace_len) != trace_len) {
+			if (write(STDERR_FILENO, error, sizeof(error) - 1) < 0) {
+				// Nowhere left to report it
+			}
+		}
+		trace_len = 0;
+	}
+}
+
+void trace_write(const unsigned char *bytes, int size)
+{
+	struct timespec now;
+	unsigned int delta_us = 0;
+
+	if (trace_fd < 0 || size <= 0)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (last_ts.tv_sec || last_ts.tv_nsec)
+		delta_us = (now.tv_sec - last_ts.tv_sec) * 1000000 +
+			(now.tv_nsec - last_ts.tv_nsec) / 1000;
+	last_ts = now;
+
+	if (trace_len + TRACE_RECORD_HEADER + size > TRACE_BUF_SIZE)
+		trace_flush();
+
+	put_le(&trace_buf[trace_len], delta_us, 4);
+	put_le(&trace_buf[trace_len + 4], size, 2);
+	memcpy(&trace_buf[trace_len + TRACE_RECORD_HEADER], bytes, size);
+	trace_len += TRACE_RECORD_HEADER + size;
+}
+
+int trace_open_read(const char *path)
+{
+	char magic[TRACE_MAGIC_LEN];
+
+	trace_fd = open(path, O_RDONLY);
+	if (trace_fd < 0) {
+		printf("Unable to open trace file %s\n", path);
+		return -1;
+	}
+	if (read(trace_fd, magic, TRACE_MAGIC_LEN) != TRACE_MAGIC_LEN ||
+		memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_LEN) != 0) {
+		printf("%s is not a touchscreen trace file\n", path);
+		trace_close();
+		return -1;
+	}
+	return 0;
+}
+
+int trace_read(unsigned char *bytes, int size, unsigned int *delta_us)
+{
+	// Returns the length of the next record, 0 at the end of the trace or
+	// -1 if the trace is damaged.
+	unsigned char header[TRACE_RECORD_HEADER];
+	int len, ret;
+
+	ret = read(trace_fd, header, TRACE_RECORD_HEADER);
+	if (ret == 0)
+		return 0;
+	if (ret != TRACE_RECORD_HEADER)
+		return -1;
+
+	*delta_us = get_le(header, 4);
+	len = get_le(&header[4], 2);
+	if (len > size || read(trace_fd, bytes, len) != len)
+		return -1;
+	return len;
+}
+
+void trace_rewind(void)
+{
+	lseek(trace_fd, TRACE_MAGIC_LEN, SEEK_SET);
+}
+
+void trace_close(void)
+{
+	trace_flush();
+	if (trace_fd >= 0)
+		close(trace_fd);
+	trace_fd = -1;
+}
@@ -0,0 +1,50 @@
+/*
+ * Record and replay support for the HP Touchpad userspace touchscreen
+ * driver.  Raw UART data is stored along with the time between reads so
+ * that recorded gestures can be fed back through the driver later.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *
+ * Copyright (c) 2012 CyanogenMod Touchpad Project.
+ *
+ *
+ */
+
+// Trace file layout:
+//   8 byte magic (TRACE_MAGIC)
+//   records of: 4 byte little endian microseconds since the previous
+//               record, 2 byte little endian length, then the raw bytes
+//               exactly as returned by a single read() of the uart
+#define TRACE_MAGIC "TSTRACE1"
+#define TRACE_MAGIC_LEN 8
+#define TRACE_RECORD_HEADER 6
+
+// Size of the capture buffer, capture data is written out when it fills
+#define TRACE_BUF_SIZE 65536
+
+int trace_open_write(const char *path);
+
+void trace_write(const unsigned char *bytes, int size);
+
+void trace_flush(void);
+
+int trace_open_read(const char *path);
+
+int trace_read(unsigned char *bytes, int size, unsigned int *delta_us);
+
+void trace_rewind(void);
+
+void trace_close(void);
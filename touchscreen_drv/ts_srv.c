@@ -29,6 +29,16 @@
  *
  */
 
+/* Usage:
+ * ts_srv                       normal operation
+ * ts_srv -c <file>             normal operation, also record all uart data
+ *                              to a trace file
+ * ts_srv -r <file> -o <out>    replay a trace file and write the resulting
+ *                              input events to out instead of uinput
+ * ts_srv -b <file> [-n runs]   benchmark the driver against a trace file
+ * Add -S to replay or benchmark with the stylus thresholds.
+ */
+
 #include <linux/input.h>
 #include <linux/uinput.h>
 #include <linux/hsuart.h>
@@ -42,11 +52,30 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
-#include <sys/select.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/poll.h>
+#include <pthread.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
 
 #include "digitizer.h"
+#include "trace.h"
+#include "assign.h"
+#include "frame_ring.h"
+#include "telemetry.h"
+#include "tap.h"
+#include "key_protocol.h"
+#include "edge.h"
+#include "levmar-2.5/levmar.h"
+#include "levmar-2.5/lmdemo.h"
 
 #if 1
 // This is for Android
@@ -63,6 +92,8 @@
 #define TS_SETTINGS_FILE "/data/tssettings"
 // Set to 1 to enable settings file debug information
 #define TS_SETTINGS_DEBUG 0
+// Edge correction table made with ts_srv -E
+#define EDGE_TABLE_FILE "/data/tsedge"
 
 /* Set to 1 to print coordinates to stdout. */
 #define DEBUG 0
@@ -80,11 +111,58 @@
 
 #define AVG_FILTER 1
 
+// Set to 1 to follow each touch with an alpha-beta filter instead of the
+// averaging filter.  The filter smooths the location and then moves it
+// ahead along the touch's velocity to make up for the time it takes for a
+// touch to show up on the screen.
+#define PREDICT_FILTER 0
+// How much of the difference between the measured and the expected
+// location is used to correct the location and the velocity, out of 256
+#define PREDICT_ALPHA 160
+#define PREDICT_BETA 48
+// How far ahead the touch is reported, in percent of a frame
+#define PREDICT_LEAD 100
+
 #define USERSPACE_270_ROTATE 0
 
 #define RECV_BUF_SIZE 1540
+// Lines from the digitizer start with 0xFF then the type. A row line (0x43)
+// has the row number and 40 values, an end of frame line (0x47) has its
+// length after the type.
+#define ROW_LINE_LEN 44
+#define MAX_LINE_LEN (255 + 4)
+// Set to 1 to skip frames that are missing rows instead of using the rows
+// left over from the last frame. If the digitizer only ever sent partial
+// scans this would drop all input, so it is off by default.
+#define DROP_INCOMPLETE_FRAMES 0
+// Most events that are sent at once, this holds a full frame of touches
+#define EVENT_QUEUE_SIZE 128
+// Touches are lifted off when no data has come from the uart for this many
+// microseconds
 #define LIFTOFF_TIMEOUT 25000
-#define SOCKET_BUFFER_SIZE 10
+int liftoff_timeout = LIFTOFF_TIMEOUT;
+#define SOCKET_BUFFER_SIZE 256
+// Most socket clients that can stay connected at once
+#define MAX_SOCKET_CLIENTS 4
+// Most events handled for each epoll_wait
+#define MAX_EPOLL_EVENTS (MAX_SOCKET_CLIENTS + 4)
+
+// The uart is read by its own thread which hands complete frames to the
+// processing thread. Each thread is pinned to a cpu, -1 lets it run on any
+// cpu. The reader gets the higher RT priority so that it can keep up with
+// the uart while a frame is being processed.
+#define READER_CPU 0
+#define PROCESS_CPU 1
+#define READER_PRIORITY 99
+#define PROCESS_PRIORITY 98
+#define FRAME_RING_DEBUG 0 // Set to 1 to print the frame ring counters
+
+// Number of times the trace is processed when benchmarking
+#define BENCH_DEFAULT_RUNS 10
+// Number of touch assignments solved per run when benchmarking them
+#define BENCH_ASSIGN_SOLVES 10000
+// Number of peak windows fitted per run when benchmarking the peak fit
+#define BENCH_FIT_WINDOWS 1000
 
 #define MAX_TOUCH 10 // Max touches that will be reported
 
@@ -93,17 +171,25 @@
 // and another will be reported as 2 separate touches instead of a swipe.
 // This distance is in pixels.
 #define MAX_DELTA 130
+int max_delta = MAX_DELTA;
 // If we exceed MAX_DELTA, we'll check the previous touch point to see if
 // it was moving fairly far.  If the previous touch moved far enough and is
 // within the same direction / angle, we'll allow it to be a swipe.
 // This is the distance theshold that the previous touch must have traveled.
 // This value is in pixels.
 #define MIN_PREV_DELTA 40
+int min_prev_delta = MIN_PREV_DELTA;
 // This is the angle, plus or minus that the previous direction must have
-// been traveling.  This angle is an arctangent. (atan2)
+// been traveling.  This angle is in radians.
 #define MAX_DELTA_ANGLE 0.25
+int max_delta_angle_mrad = MAX_DELTA_ANGLE * 1000;
 #define MAX_DELTA_DEBUG 0 // Set to 1 to see debug logging for max delta
 
+// Touches are matched up with the previous touches so that the total of the
+// squared distances is as small as possible.  A touch is never matched with
+// a previous touch further away than this many pixels.
+#define TRACK_GATE 500
+
 // Any touch above this threshold is immediately reported to the system
 #define TOUCH_INITIAL_THRESHOLD 32
 int touch_initial_thresh = TOUCH_INITIAL_THRESHOLD;
@@ -126,6 +212,23 @@ int touch_delay_count = TOUCH_DELAY;
 // thresholds.
 #define LARGE_AREA_UNPRESS 22 //TOUCH_CONTINUE_THRESHOLD
 #define LARGE_AREA_FRINGE 5 // Threshold for large area fringe
+int large_area_fringe = LARGE_AREA_FRINGE;
+// Set to 1 to leave out touches shaped like a palm or the side of a hand,
+// so they are never sent. A touch is a palm if its core covers at least
+// PALM_AREA points, if the core is stretched out so that the variance of
+// its points along the long axis is at least PALM_LENGTH_SQ, or if it
+// covers at least PALM_FLAT_AREA points and its highest point carries less
+// than 1 / PALM_FLAT_RATIO of its weight. Palms are still tracked so that
+// they stay left out. A touch that is being tracked only turns from a
+// finger into a palm, or back, once it has been shaped like the other for
+// PALM_FRAMES frames in a row. A palm that turns into a finger is sent as a
+// new touch.
+#define PALM_REJECT 1
+#define PALM_AREA 30
+#define PALM_LENGTH_SQ 6
+#define PALM_FLAT_AREA 12
+#define PALM_FLAT_RATIO 40
+#define PALM_FRAMES 8
 
 // These are stylus thresholds:
 #define TOUCH_INITIAL_THRESHOLD_S  32
@@ -133,11 +236,102 @@ int touch_delay_count = TOUCH_DELAY;
 #define TOUCH_DELAY_THRESHOLD_S    24
 #define TOUCH_DELAY_S               2
 
+// Set to 1 to track the resting value and the noise of each point of the
+// digitizer. The matrix then holds how far each point is above its
+// baseline. The thresholds above are compared with that value scaled by
+// the noise of the point, so they are in units of noise instead of raw
+// values and a noisy edge doesn't force them up everywhere. Locations,
+// weights and fits use the values before scaling. The baseline and the
+// noise are learned from frames without touches. Light touches stand out
+// from the noise without waiting, so TOUCH_DELAY isn't used. It is off by
+// default as the thresholds above were tuned for raw values and would have
+// to be tuned again in units of noise.
+#define BASELINE_FILTER 0
+// Each frame without touches counts for 1 / 2^BASELINE_SHIFT of the
+// baseline once the first 2^BASELINE_SHIFT frames have been averaged
+#define BASELINE_SHIFT 6
+// In frames with touches the baseline of the points outside of them moves
+// 1 / 2^BASELINE_SLOW_SHIFT of the way to their value, so that it follows
+// drift. Points at or above large_area_fringe are left alone so that a touch
+// held still doesn't fade into the baseline. A point that a wrong baseline
+// keeps above it stays that way until K1 calibrate.
+#define BASELINE_SLOW_SHIFT 11
+// Value that one standard deviation of noise is scaled to. A point with
+// this much noise keeps its values apart from the baseline.
+#define NOISE_REF 2
+// Lowest noise used for scaling so quiet points aren't blown up
+#define NOISE_FLOOR 1
+// Points further above their baseline than this many standard deviations
+// are left out of the baseline, they are likely touches below threshold
+#define BASELINE_TOUCH_SIGMAS 4
+#define BASELINE_DEBUG 0 // Set to 1 to print the baseline and noise
+
+// Detector used to find the touches in each frame, see detectors[]:
+// 0 = flood fill of the areas above the thresholds
+// 1 = local peaks, fitted with a Gaussian near the edges and other touches
+// It can also be changed with ts_srv_set set detector=N or -d.
+#define DETECTOR 0
+int detector_type = DETECTOR;
+// Points above touch_continue_thresh that are at least as high as the points
+// around them are peaks. Peaks within PEAK_RADIUS points of a stronger
+// touch are part of that touch.
+#define PEAK_RADIUS 2
+#define MAX_PEAKS 75 // Most peaks looked at in each frame
+// Rows are padded to whole NEON registers when the peaks are found
+#define PEAK_ROW_BYTES 48
+// The center of a peak is the weighted average of the points within
+// PEAK_AVG_RADIUS. Peaks within PEAK_FIT_EDGE points of the edge, or
+// closer to another peak than sqrt(PEAK_FIT_NEAR_SQ) points, are fitted
+// with a Gaussian over the points within PEAK_FIT_RADIUS instead.
+#define PEAK_AVG_RADIUS 4
+#define PEAK_FIT_RADIUS 2
+#define PEAK_FIT_EDGE 4
+#define PEAK_FIT_NEAR_SQ 16
+// Set to 1 to fit peaks with the general levmar solver instead of the fixed
+// size one
+#define PEAK_FIT_LEVMAR 0
+// Set to 1 to start the fit of a peak from the fit of the touch at the same
+// place in the last frame, moved along with the touch. A fit that wanders
+// off is done again from scratch.
+#define PEAK_FIT_WARM 1
+// Set to 1 to fit peaks that are close together with a sum of Gaussians
+// over one window, so that fingers held together are still told apart.
+// Up to FIT_MAX_GAUSSIANS peaks closer than sqrt(PEAK_FIT_NEAR_SQ) points
+// to the strongest one are fitted together if the window around them is
+// at most FIT_JOINT_MAX_SIZE points on a side. If the fitted centers end
+// up closer than PEAK_JOINT_MIN_SEP points, or one of the Gaussians is no
+// higher than touch_continue_thresh, the peaks are fitted one by one.
+#define PEAK_FIT_JOINT 1
+#define PEAK_JOINT_MIN_SEP 1.0f
+// Set to 1 to move peaks near the edge that aren't close to another peak
+// with the edge correction table instead of fitting them, when a table is
+// loaded. Tables are made from recorded traces with ts_srv -E, the live
+// driver loads EDGE_TABLE_FILE if there is one.
+#define PEAK_EDGE_TABLE 1
+// Only touches with no other peak closer than sqrt(EDGE_CALIB_CLEAR_SQ)
+// points go into a table, others pull the weighted average toward them.
+#define EDGE_CALIB_CLEAR_SQ 64
+// When at least FIT_PARALLEL_MIN peaks need fitting in one frame, the fits
+// are shared between the processing thread and FIT_WORKERS more threads.
+// The workers are pinned to FIT_CPU, which is free while the reader waits
+// for the uart, below the priority of the other two threads. ts_srv -f
+// measures what handing the jobs over costs: several times a fixed size
+// fit, but less than a levmar fit, so only levmar fits are shared.
+#if PEAK_FIT_LEVMAR
+#define FIT_WORKERS 1
+#else
+#define FIT_WORKERS 0
+#endif
+#define FIT_PARALLEL_MIN 3
+#define FIT_CPU READER_CPU
+#define FIT_PRIORITY 97
+
 // Enables filtering of a single touch to make it easier to long press.
 // Keeps the initial touch point the same so long as it stays within
 // the radius (note it's not really a radius and is actually a square)
 #define DEBOUNCE_FILTER 1 // Set to 1 to enable the debouce filter
 #define DEBOUNCE_RADIUS 10 // Radius for debounce in pixels
+int debounce_radius = DEBOUNCE_RADIUS;
 #define DEBOUNCE_DEBUG 0 // Set to 1 to enable debounce logging
 
 // Enables filtering after swiping to prevent the slight jitter that
@@ -149,40 +343,68 @@ int touch_delay_count = TOUCH_DELAY;
 #define HOVER_DEBOUNCE_RADIUS 2 // Radius for hover debounce in pixels
 #define HOVER_DEBOUNCE_DELAY 30 // Count of delay before we start debouncing
 #define HOVER_DEBOUNCE_DEBUG 0 // Set to 1 to enable hover debounce logging
+int hover_debounce_radius = HOVER_DEBOUNCE_RADIUS;
+int hover_debounce_delay = HOVER_DEBOUNCE_DELAY;
 
 // This is used to help calculate ABS_TOUCH_MAJOR
 // This is roughly the value of 1024 / 40 or 768 / 30
 #define PIXELS_PER_POINT 25
+int pixels_per_point = PIXELS_PER_POINT;
 
-// This enables slots for the type B multi-touch protocol.
+// This enables slots for the type B multi-touch protocol by default.
 // The kernel must support slots (ABS_MT_SLOT). The TouchPad 2.6.35 kernel
 // doesn't seem to handle liftoffs with protocol B properly so leave it off
-// for now.
+// for now.  The protocol can also be changed with ts_srv_set or -B.
 #define USE_B_PROTOCOL 0
 
 /** ------- end of user modifiable parameters ---- */
 #define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
 #define MAX(X,Y) ((X) > (Y) ? (X) : (Y))
 #define isBetween(A, B, C) ( ((A-B) > 0) && ((A-C) < 0) )
-// We square MAX_DELTA to prevent the need to use sqrt
-#define MAX_DELTA_SQ (MAX_DELTA * MAX_DELTA)
-#define MIN_PREV_DELTA_SQ (MIN_PREV_DELTA * MIN_PREV_DELTA)
+#define TRACK_GATE_SQ (TRACK_GATE * TRACK_GATE)
+// These are worked out from the tuning parameters by apply_params(). We
+// square max_delta to prevent the need to use sqrt. The tangent of the max
+// delta angle is squared and kept with 16 fractional bits, directions are
+// compared with cross and dot products so that no atan2 is needed.
+int max_delta_sq, min_prev_delta_sq;
+long long max_delta_tan_sq;
+#if MAX_TOUCH > ASSIGN_MAX
+#error "MAX_TOUCH is larger than the touch assignment supports"
+#endif
+#if 2 * PEAK_FIT_RADIUS + 1 > FIT_MAX_SIZE
+#error "PEAK_FIT_RADIUS is larger than the peak fit supports"
+#endif
 
 #define X_AXIS_POINTS  30
 #define Y_AXIS_POINTS  40
 #define X_AXIS_MINUS1 X_AXIS_POINTS - 1 // 29
+#define ALL_ROWS ((1U << X_AXIS_POINTS) - 1)
 #define Y_AXIS_MINUS1 Y_AXIS_POINTS - 1 // 39
+#if Y_AXIS_POINTS > PEAK_ROW_BYTES || Y_AXIS_POINTS > 64
+#error "The peak candidate bitmap does not fit a row"
+#endif
+
+// Weighted location sums use pow(value, 1.5) with WEIGHT_SHIFT fractional
+// bits and touch locations in the matrix have LOCATION_SHIFT fractional bits
+// so that the center point can be found without floating point math.
+#define WEIGHT_SHIFT 3
+#define LOCATION_SHIFT 8
+#if LOCATION_SHIFT != EDGE_SHIFT
+#error "Edge correction tables are in different units than the touches"
+#endif
 
+// A location in the matrix is scaled to pixels by multiplying with the
+// resolution and dividing by the LOCATION_DIV of that axis
 #if USERSPACE_270_ROTATE
 #define X_RESOLUTION  768
 #define Y_RESOLUTION 1024
-#define X_LOCATION_VALUE ((float)X_RESOLUTION) / ((float)X_AXIS_MINUS1)
-#define Y_LOCATION_VALUE ((float)Y_RESOLUTION) / ((float)Y_AXIS_MINUS1)
+#define X_LOCATION_DIV ((X_AXIS_MINUS1) << LOCATION_SHIFT)
+#define Y_LOCATION_DIV ((Y_AXIS_MINUS1) << LOCATION_SHIFT)
 #else
 #define X_RESOLUTION 1024
 #define Y_RESOLUTION  768
-#define X_LOCATION_VALUE ((float)X_RESOLUTION) / ((float)Y_AXIS_MINUS1)
-#define Y_LOCATION_VALUE ((float)Y_RESOLUTION) / ((float)X_AXIS_MINUS1)
+#define X_LOCATION_DIV ((Y_AXIS_MINUS1) << LOCATION_SHIFT)
+#define Y_LOCATION_DIV ((X_AXIS_MINUS1) << LOCATION_SHIFT)
 #endif // USERSPACE_270_ROTATE
 
 #define X_RESOLUTION_MINUS1 X_RESOLUTION - 1
@@ -192,20 +414,20 @@ struct touchpoint {
 	// Power or weight of the touch, used for calculating the center point.
 	int pw;
 	// These store the average of the locations in the digitizer matrix that
-	// make up the touch.  Used for calculating the center point.
-	float i;
-	float j;
-#if USE_B_PROTOCOL
+	// make up the touch with LOCATION_SHIFT fractional bits.  Used for
+	// calculating the center point.
+	int i;
+	int j;
 	// Slot used for the B protocol touch events.
 	int slot;
-#endif
 	// Tracking ID that is assigned to this touch.
 	int tracking_id;
 	// Index location of this touch in the previous set of touches.
 	int prev_loc;
 #if MAX_DELTA_FILTER
 	// Direction and distance between this touch and the previous touch.
-	float direction;
+	int dir_x;
+	int dir_y;
 	int distance;
 #endif
 	// Size of the touch area.
@@ -221,6 +443,23 @@ struct touchpoint {
 	int highest_val;
 	// Delay count for touches that do not have a very high highest_val.
 	int touch_delay;
+	// Height of the Gaussian fitted to the touch by the peak detector, 0 if
+	// it wasn't fitted
+	float fit_value;
+	// Set if the touch is left out as a palm. It starts out set if the
+	// touch area is shaped like a palm and is updated once it is tracked.
+	int palm;
+	// Frames in a row that the touch has been shaped like a palm while
+	// taken for a finger, or the other way around
+	int shape_frames;
+#if PREDICT_FILTER
+	// Smoothed location and velocity per frame of the touch with
+	// LOCATION_SHIFT fractional bits
+	int pred_x;
+	int pred_y;
+	int vel_x;
+	int vel_y;
+#endif
 #if HOVER_DEBOUNCE_FILTER
 	// Location that we are tracking for hover debounce
 	int hover_x;
@@ -234,29 +473,201 @@ struct touchpoint {
 struct touchpoint tp[3][MAX_TOUCH];
 // These indexes locate the appropriate set of touches in tp
 int tpoint, prevtpoint, prev2tpoint;
+// Number of touches in tp[prevtpoint]
+int previoustpc;
 
-// Used for reading data from the digitizer
-unsigned char cline[64];
+// Used for reading data from the digitizer, only holds a line that was cut
+// off at the end of a read
+unsigned char cline[MAX_LINE_LEN];
 // Index used for cline
 unsigned int cidx = 0;
+// Bitmap of the rows of the current frame that have arrived so far
+unsigned int frame_rows;
+
+struct parse_stats {
+	// Lines that were cut off by the 0xFF of another line
+	unsigned int aborted_lines;
+	// Times that data had to be skipped to find the start of a line
+	unsigned int resyncs;
+	// Frames that were missing rows
+	unsigned int incomplete_frames;
+} parse_stats;
 // Contains all of the data from the digitizer
 unsigned char matrix[X_AXIS_POINTS][Y_AXIS_POINTS];
-// Indicates if a point in the digitizer matrix has already been scanned.
-int invalid_matrix[X_AXIS_POINTS][Y_AXIS_POINTS];
+#if X_AXIS_POINTS * Y_AXIS_POINTS != FRAME_RING_SLOT_SIZE
+#error FRAME_RING_SLOT_SIZE does not match the matrix
+#endif
+#if MAX_TOUCH > TAP_MAX_TOUCH || X_AXIS_POINTS != TAP_ROWS || \
+	Y_AXIS_POINTS != TAP_COLS
+#error "The tap frame layout doesn't match the driver"
+#endif
+// Rows from the uart are written here. While the reader thread is running
+// this is the frame of the ring that is being filled instead of matrix.
+unsigned char (*line_matrix)[Y_AXIS_POINTS] = matrix;
+int use_frame_ring;
+// While the reader thread is running the rows of a frame are copied into
+// matrix as they land in the ring. This is the number of the frame they
+// came from and the rows copied so far, 0 if there are none.
+unsigned int matrix_frame;
+unsigned int matrix_rows;
+#if BASELINE_FILTER
+// Resting value and noise variance of each point with 8 fractional bits
+int baseline[X_AXIS_POINTS][Y_AXIS_POINTS];
+int noise_var[X_AXIS_POINTS][Y_AXIS_POINTS];
+// Scale from a value above the baseline to units of noise, 8 fractional
+// bits
+int noise_gain[X_AXIS_POINTS][Y_AXIS_POINTS];
+// Digitizer values of the current frame before the baseline is taken off
+unsigned char raw_matrix[X_AXIS_POINTS][Y_AXIS_POINTS];
+// Values above the baseline in units of noise, for the thresholds
+unsigned char level[X_AXIS_POINTS][Y_AXIS_POINTS];
+// Frames the baseline has learned from, up to 2^BASELINE_SHIFT
+int baseline_frames;
+// Set by K1 calibrate to start learning the baseline over
+volatile int baseline_recalibrate;
+#define LEVEL(i, j) level[i][j]
+#define LEVEL_ROW(i) level[i]
+#else
+#define LEVEL(i, j) matrix[i][j]
+#define LEVEL_ROW(i) matrix[i]
+#endif
+// Weight of each value in the digitizer matrix, see WEIGHT_SHIFT. The total
+// weight of a touch has always been a sum of whole numbers, which is kept
+// so that the center points don't move.
+int weight_table[256];
+int int_weight_table[256];
+
+// Touches are found with two linear passes over the matrix instead of a
+// recursive flood fill. Points at or above LARGE_AREA_UNPRESS make up the
+// core of a touch and are labeled row by row with a union-find. Points
+// between LARGE_AREA_FRINGE and LARGE_AREA_UNPRESS make up the fringe and
+// belong to a touch if they can be reached from its core by only stepping
+// to lower values.
+struct touch_area {
+	// Weight and weighted location sums used for the center point
+	int tweight;
+	int isum;
+	int jsum;
+	// Bounding box and highest value of the core points, compared with the
+	// thresholds, and the weight of the highest point
+	int mini, maxi, minj, maxj;
+	int highest_val;
+	int highest_weight;
+	// Number of core points and the sums of their locations, squared
+	// locations and products of the locations, for the shape of the touch
+	int cells;
+	int ci, cj;
+	int cii, cjj, cij;
+};
+
+struct core {
+	// Union-find parent, a core is a root if it is its own parent
+	unsigned short parent;
+	// Touch index + 1 that this core belongs to, 0 if none yet
+	unsigned char touch_id;
+	// MATRIX_INDEX of the first point above touch_continue_thresh, -1 if
+	// there is none
+	short first_seed;
+	struct touch_area area;
+};
+
+// A new core label is only created for a point that has no core neighbor
+// to its left or above, so at most every other point of a row gets one.
+#define MAX_CORES ((X_AXIS_POINTS * Y_AXIS_POINTS) / 2)
+#define MAX_FRINGE_LEVELS LARGE_AREA_UNPRESS
+#define FRINGE_LEVELS (LARGE_AREA_UNPRESS - large_area_fringe)
+#define MATRIX_INDEX(i, j) ((i) * Y_AXIS_POINTS + (j))
+#define TOUCH_BIT(touch_id) (1 << ((touch_id) - 1))
+#if MAX_TOUCH > 16
+#error "Touch bit masks of fringe points only hold 16 touches"
+#endif
+
+struct fringe_point {
+	// Touches handed down to the point by its higher neighbors
+	unsigned short owners;
+	// Touches the point was added to
+	unsigned short touches;
+};
+
+// Core label of each point, 0 for points that aren't part of a core
+unsigned short core_label[X_AXIS_POINTS][Y_AXIS_POINTS];
+struct core cores[MAX_CORES + 1];
+int core_count;
+// Lists of fringe points for each value, linked by MATRIX_INDEX
+short fringe_head[MAX_FRINGE_LEVELS];
+short fringe_next[X_AXIS_POINTS * Y_AXIS_POINTS];
+// Only fringe points are looked at and they are set up again as their row
+// is labeled, so this doesn't need to be cleared for each frame
+struct fringe_point fringe[X_AXIS_POINTS][Y_AXIS_POINTS];
+// Fringe points above touch_continue_thresh in scan order
+short fringe_seeds[X_AXIS_POINTS * Y_AXIS_POINTS];
+int fringe_seed_count;
+// Rows are labeled as they arrive from the digitizer. This is the next row
+// to label, or -1 if the rows of this frame can't be labeled in order and
+// the whole matrix has to be labeled at the end of the frame.
+int next_label_row = -1;
 // File descriptor for uinput device
 int uinput_fd;
-#if USE_B_PROTOCOL
+// Events waiting to be written to event_fd
+struct input_event event_queue[EVENT_QUEUE_SIZE];
+int event_count;
+int event_fd;
+// Count of complete frames received from the digitizer
+unsigned int frame_count;
+// Time of the uart read that is being parsed, and of the read that completed
+// the frame being processed. frame_read_ns goes back to 0 once the latency
+// of the frame has been counted, or at the end of calc_point() if the frame
+// sent nothing.
+long long read_ns;
+long long frame_read_ns;
+// The main loop waits on epoll_fd for data from the uart and socket and for
+// the timers. liftoff_timer_fd goes off liftoff_timeout after the last uart
+// data and power_timer_fd times the steps of powering the digitizer on and
+// off.
+int epoll_fd = -1;
+int liftoff_timer_fd = -1;
+int power_timer_fd = -1;
+// Set to 1 when the digitizer is being powered on, 0 when powered off
+int power_enable = 1;
+
+// Connected socket clients, fd is -1 for unused entries. A K command is
+// collected in line until its newline, line_len is -1 outside of one.
+// tapped is set once the client has asked for the tap.
+struct socket_client {
+	int fd;
+	char line[KEY_LINE_SIZE];
+	int line_len;
+	int tapped;
+};
+struct socket_client socket_clients[MAX_SOCKET_CLIENTS];
+
+pthread_t reader_thread;
+int reader_running;
+// Written by the reader thread when it hands over frames, and by the
+// processing thread to stop the reader
+int frame_event_fd = -1;
+int reader_stop_fd = -1;
+// Set to 1 when the type B multi-touch protocol is used
+int use_b_protocol = USE_B_PROTOCOL;
 // Indicates which slots are in use
 int slot_in_use[MAX_TOUCH];
-#endif
-
-int send_uevent(int fd, __u16 type, __u16 code, __s32 value)
-{
-	struct input_event event;
+// Values that were last sent for each slot, -1 if unknown. Only values
+// that change are sent again with protocol B.
+struct slot_values {
+	int tracking_id;
+	int touch_major;
+	int x;
+	int y;
+};
+struct slot_values sent_slots[MAX_TOUCH];
+// Slot that the last ABS_MT_SLOT event selected, -1 if unknown
+int current_slot = -1;
 
 #if EVENT_DEBUG
+void print_uevent(struct input_event *event)
+{
 	char ctype[20], ccode[20];
-	switch (type) {
+	switch (event->type) {
 		case EV_ABS:
 			strcpy(ctype, "EV_ABS");
 			break;
@@ -267,7 +678,7 @@ int send_uevent(int fd, __u16 type, __u16 code, __s32 value)
 			strcpy(ctype, "EV_SYN");
 			break;
 	}
-	switch (code) {
+	switch (event->code) {
 		case ABS_MT_SLOT:
 			strcpy(ccode, "ABS_MT_SLOT");
 			break;
@@ -293,20 +704,54 @@ int send_uevent(int fd, __u16 type, __u16 code, __s32 value)
 			strcpy(ccode, "BTN_TOUCH");
 			break;
 	}
-	printf("event type: '%s' code: '%s' value: %i \n", ctype, ccode, value);
-#endif
+	printf("event type: '%s' code: '%s' value: %i \n", ctype, ccode,
+		event->value);
+}
+#endif // EVENT_DEBUG
 
-	memset(&event, 0, sizeof(event));
-	event.type = type;
-	event.code = code;
-	event.value = value;
+int flush_uevents(void)
+{
+	// Writes all of the queued events with a single write
+	int size = event_count * sizeof(struct input_event), ret = 0;
 
-	if (write(fd, &event, sizeof(event)) != sizeof(event)) {
-		fprintf(stderr, "Error on send_event %d", sizeof(event));
-		return -1;
+	if (!event_count)
+		return 0;
+	if (write(event_fd, event_queue, size) != size) {
+		fprintf(stderr, "Error on send_event %d", size);
+		ret = -1;
+	}
+	if (frame_read_ns && event_queue[event_count - 1].type == EV_SYN &&
+		event_queue[event_count - 1].code == SYN_REPORT) {
+		telemetry_latency(telemetry_now_ns() - frame_read_ns);
+		frame_read_ns = 0;
 	}
+	event_count = 0;
+	return ret;
+}
 
-	return 0;
+int send_uevent(int fd, __u16 type, __u16 code, __s32 value)
+{
+	// Events are queued up and sent all at once with the SYN_REPORT that
+	// ends the frame
+	struct input_event *event;
+	int ret = 0;
+
+	if (event_count && (fd != event_fd || event_count == EVENT_QUEUE_SIZE))
+		ret = flush_uevents();
+	event_fd = fd;
+
+	event = &event_queue[event_count++];
+	memset(event, 0, sizeof(*event));
+	event->type = type;
+	event->code = code;
+	event->value = value;
+#if EVENT_DEBUG
+	print_uevent(event);
+#endif
+
+	if (type == EV_SYN && code == SYN_REPORT)
+		ret |= flush_uevents();
+	return ret;
 }
 
 #if AVG_FILTER
@@ -314,7 +759,7 @@ void avg_filter(struct touchpoint *t) {
 #if DEBUG
 	printf("before: x=%d, y=%d", t->x, t->y);
 #endif
-	float total_div = 6.0;
+	int total_div = 6;
 	int xsum = 4 * t->unfiltered_x + 2 *
 		tp[prevtpoint][t->prev_loc].unfiltered_x;
 	int ysum = 4 * t->unfiltered_y + 2 *
@@ -325,7 +770,7 @@ void avg_filter(struct touchpoint *t) {
 			tp[prev2tpoint][tp[prevtpoint][t->prev_loc].prev_loc].unfiltered_x;
 		ysum +=
 			tp[prev2tpoint][tp[prevtpoint][t->prev_loc].prev_loc].unfiltered_y;
-		total_div += 1.0;
+		total_div++;
 	}
 	t->x = xsum / total_div;
 	t->y = ysum / total_div;
@@ -335,6 +780,36 @@ void avg_filter(struct touchpoint *t) {
 }
 #endif // AVG_FILTER
 
+#if PREDICT_FILTER
+int predict_axis(int *pos, int *vel, int prev_pos, int prev_vel,
+	int measured, int max) {
+	// Moves the location ahead by one frame and corrects the location and
+	// velocity with the measured location. Returns the location to report.
+	int expected = prev_pos + prev_vel;
+	int error = (measured << LOCATION_SHIFT) - expected;
+	int reported;
+
+	*pos = expected + error * PREDICT_ALPHA / 256;
+	*vel = prev_vel + error * PREDICT_BETA / 256;
+	reported = (*pos + *vel * PREDICT_LEAD / 100) / (1 << LOCATION_SHIFT);
+	return MAX(0, MIN(reported, max));
+}
+
+void predict_filter(struct touchpoint *t) {
+	struct touchpoint *prev = &tp[prevtpoint][t->prev_loc];
+#if DEBUG
+	printf("before: x=%d, y=%d", t->x, t->y);
+#endif
+	t->x = predict_axis(&t->pred_x, &t->vel_x, prev->pred_x, prev->vel_x,
+		t->unfiltered_x, X_RESOLUTION_MINUS1);
+	t->y = predict_axis(&t->pred_y, &t->vel_y, prev->pred_y, prev->vel_y,
+		t->unfiltered_y, Y_RESOLUTION_MINUS1);
+#if DEBUG
+	printf("|||| after: x=%d, y=%d\n", t->x, t->y);
+#endif
+}
+#endif // PREDICT_FILTER
+
 #if HOVER_DEBOUNCE_FILTER
 void hover_debounce(int i) {
 	int prev_loc = tp[tpoint][i].prev_loc,
@@ -345,13 +820,13 @@ void hover_debounce(int i) {
 	// all within the HOVER_DEBOUNCE_RADIUS
 	if (prev2_loc >= 0 &&
 		abs(tp[tpoint][i].x - tp[prevtpoint][prev_loc].x) <
-		HOVER_DEBOUNCE_RADIUS &&
+		hover_debounce_radius &&
 		abs(tp[tpoint][i].y - tp[prevtpoint][prev_loc].y) <
-		HOVER_DEBOUNCE_RADIUS &&
+		hover_debounce_radius &&
 		abs(tp[tpoint][i].x - tp[prev2tpoint][prev2_loc].x) <
-		HOVER_DEBOUNCE_RADIUS &&
+		hover_debounce_radius &&
 		abs(tp[tpoint][i].y - tp[prev2tpoint][prev2_loc].y) <
-		HOVER_DEBOUNCE_RADIUS) {
+		hover_debounce_radius) {
 		if (!tp[tpoint][i].hover_delay) {
 			tp[tpoint][i].x = tp[prevtpoint][prev_loc].x;
 			tp[tpoint][i].y = tp[prevtpoint][prev_loc].y;
@@ -369,12 +844,52 @@ void hover_debounce(int i) {
 		}
 	} else {
 		// We have moved too far for hover debouce, reset the delay counter.
-		tp[tpoint][i].hover_delay = HOVER_DEBOUNCE_DELAY;
+		tp[tpoint][i].hover_delay = hover_debounce_delay;
 	}
 }
 #endif // HOVER_DEBOUNCE_FILTER
 
-#if USE_B_PROTOCOL
+void reset_slots(void) {
+	// Forgets what was sent for each slot, for a new uinput device
+	int i;
+
+	for (i=0; i<MAX_TOUCH; i++) {
+		slot_in_use[i] = 0;
+		sent_slots[i].tracking_id = -1;
+		sent_slots[i].touch_major = -1;
+		sent_slots[i].x = -1;
+		sent_slots[i].y = -1;
+	}
+	current_slot = -1;
+}
+
+void select_slot(int slot) {
+	if (slot != current_slot) {
+		send_uevent(uinput_fd, EV_ABS, ABS_MT_SLOT, slot);
+		current_slot = slot;
+	}
+}
+
+void send_slot_value(int slot, int *sent, __u16 code, int value) {
+	if (*sent != value) {
+		select_slot(slot);
+		send_uevent(uinput_fd, EV_ABS, code, value);
+		*sent = value;
+	}
+}
+
+void report_slot(struct touchpoint *t) {
+	// Sends the values of a slot that changed since they were last sent
+	struct slot_values *sent = &sent_slots[t->slot];
+
+	send_slot_value(t->slot, &sent->tracking_id, ABS_MT_TRACKING_ID,
+		t->tracking_id);
+	send_slot_value(t->slot, &sent->touch_major, ABS_MT_TOUCH_MAJOR,
+		t->touch_major);
+	send_slot_value(t->slot, &sent->x, ABS_MT_POSITION_X, t->x);
+	send_slot_value(t->slot, &sent->y, ABS_MT_POSITION_Y, t->y);
+}
+
 void liftoff_slot(int slot) {
 	// Sends a liftoff indicator for a specific slot
 #if EVENT_DEBUG
@@ -383,400 +898,1479 @@ void liftoff_slot(int slot) {
 	// According to the Linux kernel documentation, this is the right events
 	// to send for protocol B, but the TouchPad 2.6.35 kernel doesn't seem to
 	// handle them correctly.
-	send_uevent(uinput_fd, EV_ABS, ABS_MT_SLOT, slot);
-	send_uevent(uinput_fd, EV_ABS, ABS_MT_TRACKING_ID, -1);
+	send_slot_value(slot, &sent_slots[slot].tracking_id, ABS_MT_TRACKING_ID,
+		-1);
+	// The next touch in this slot sends all of its values
+	sent_slots[slot].touch_major = -1;
+	sent_slots[slot].x = -1;
+	sent_slots[slot].y = -1;
 }
-#endif // USE_B_PROTOCOL
 
 void liftoff(void)
 {
-#if USE_B_PROTOCOL
-	// Send liftoffs for any slots that haven't been lifted off
-	int i;
-	for (i=0; i<MAX_TOUCH; i++) {
-		if (slot_in_use[i]) {
-			slot_in_use[i] = 0;
-			liftoff_slot(i);
-		}
-	}
-#endif
 	// Sends liftoff events - nothing is touching the screen
 #if EVENT_DEBUG
 	printf("liftoff function\n");
 #endif
-#if !USE_B_PROTOCOL
-	send_uevent(uinput_fd, EV_SYN, SYN_MT_REPORT, 0);
-#endif
-	send_uevent(uinput_fd, EV_SYN, SYN_REPORT, 0);
+	if (use_b_protocol) {
+		// Send liftoffs for any slots that haven't been lifted off
+		int i;
+		for (i=0; i<MAX_TOUCH; i++) {
+			if (slot_in_use[i]) {
+				slot_in_use[i] = 0;
+				liftoff_slot(i);
+			}
+		}
+		// Nothing to report if every slot was already lifted off
+		if (event_count)
+			send_uevent(uinput_fd, EV_SYN, SYN_REPORT, 0);
+	} else {
+		send_uevent(uinput_fd, EV_SYN, SYN_MT_REPORT, 0);
+		send_uevent(uinput_fd, EV_SYN, SYN_REPORT, 0);
+	}
+}
+
+int find_core(int label) {
+	// Returns the root label of a core, shortening the path as we go
+	while (cores[label].parent != label) {
+		cores[label].parent = cores[cores[label].parent].parent;
+		label = cores[label].parent;
+	}
+	return label;
 }
 
-void determine_area_loc_fringe(float *isum, float *jsum, int *tweight, int i,
-	int j, int cur_touch_id){
-	float powered;
+void init_area(struct touch_area *a) {
+	a->tweight = 0;
+	a->isum = 0;
+	a->jsum = 0;
+	a->mini = X_AXIS_POINTS;
+	a->maxi = -1;
+	a->minj = Y_AXIS_POINTS;
+	a->maxj = -1;
+	a->highest_val = 0;
+	a->highest_weight = 0;
+	a->cells = 0;
+	a->ci = 0;
+	a->cj = 0;
+	a->cii = 0;
+	a->cjj = 0;
+	a->cij = 0;
+}
 
-	// Set fringe point to used for this touch point
-	invalid_matrix[i][j] = cur_touch_id;
+void init_weight_table(void) {
+	int value;
 
-	// Track touch values to help determine the pixel x, y location
-	powered = pow(matrix[i][j], 1.5);
-	*tweight += powered;
-	*isum += powered * i;
-	*jsum += powered * j;
-
-	// Check the nearby points to see if they are above LARGE_AREA_FRINGE
-	// but still decreasing in value to ensure that they are part of the same
-	// touch and not a nearby, pinching finger.
-	if (i > 0 && invalid_matrix[i-1][j] != cur_touch_id)
-	{
-		if (matrix[i-1][j] >= LARGE_AREA_FRINGE &&
-			matrix[i-1][j] < matrix[i][j])
-			determine_area_loc_fringe(isum, jsum, tweight, i - 1, j,
-				cur_touch_id);
+	for (value=0; value<256; value++) {
+		weight_table[value] = pow(value, 1.5) * (1 << WEIGHT_SHIFT) + 0.5;
+		int_weight_table[value] = pow(value, 1.5);
 	}
-	if (i < X_AXIS_MINUS1 && invalid_matrix[i+1][j] != cur_touch_id)
-	{
-		if (matrix[i+1][j] >= LARGE_AREA_FRINGE &&
-			matrix[i+1][j] < matrix[i][j])
-			determine_area_loc_fringe(isum, jsum, tweight, i + 1, j,
-				cur_touch_id);
-	}
-	if (j > 0 && invalid_matrix[i][j-1] != cur_touch_id) {
-		if (matrix[i][j-1] >= LARGE_AREA_FRINGE &&
-			matrix[i][j-1] < matrix[i][j])
-			determine_area_loc_fringe(isum, jsum, tweight, i, j - 1,
-				cur_touch_id);
-	}
-	if (j < Y_AXIS_MINUS1 && invalid_matrix[i][j+1] != cur_touch_id)
-	{
-		if (matrix[i][j+1] >= LARGE_AREA_FRINGE &&
-			matrix[i][j+1] < matrix[i][j])
-			determine_area_loc_fringe(isum, jsum, tweight, i, j + 1,
-				cur_touch_id);
-	}
-	if (i > 0 && j > 0 && invalid_matrix[i-1][j-1] != cur_touch_id)
-	{
-		if (matrix[i-1][j-1] >= LARGE_AREA_FRINGE &&
-			matrix[i-1][j-1] < matrix[i][j])
-			determine_area_loc_fringe(isum, jsum, tweight, i - 1, j - 1,
-				cur_touch_id);
+}
+
+void add_area_weight(struct touch_area *a, int i, int j) {
+	// Track touch values to help determine the pixel x, y location
+	int weight = weight_table[matrix[i][j]];
+	a->tweight += int_weight_table[matrix[i][j]];
+	a->isum += weight * i;
+	a->jsum += weight * j;
+}
+
+void add_area_cell(struct touch_area *a, int i, int j) {
+	// Track the size of the touch for TOUCH_MAJOR
+	if (i < a->mini)
+		a->mini = i;
+	if (i > a->maxi)
+		a->maxi = i;
+	if (j < a->minj)
+		a->minj = j;
+	if (j > a->maxj)
+		a->maxj = j;
+
+	// Track the highest value of the touch to determine which threshold
+	// applies.
+	if (LEVEL(i, j) > a->highest_val)
+		a->highest_val = LEVEL(i, j);
+	if (int_weight_table[matrix[i][j]] > a->highest_weight)
+		a->highest_weight = int_weight_table[matrix[i][j]];
+
+	// Track the shape of the touch to tell palms apart from fingers
+	a->cells++;
+	a->ci += i;
+	a->cj += j;
+	a->cii += i * i;
+	a->cjj += j * j;
+	a->cij += i * j;
+
+	add_area_weight(a, i, j);
+}
+
+void merge_area(struct touch_area *dest, struct touch_area *src) {
+	dest->tweight += src->tweight;
+	dest->isum += src->isum;
+	dest->jsum += src->jsum;
+	dest->mini = MIN(dest->mini, src->mini);
+	dest->maxi = MAX(dest->maxi, src->maxi);
+	dest->minj = MIN(dest->minj, src->minj);
+	dest->maxj = MAX(dest->maxj, src->maxj);
+	dest->highest_val = MAX(dest->highest_val, src->highest_val);
+	dest->highest_weight = MAX(dest->highest_weight, src->highest_weight);
+	dest->cells += src->cells;
+	dest->ci += src->ci;
+	dest->cj += src->cj;
+	dest->cii += src->cii;
+	dest->cjj += src->cjj;
+	dest->cij += src->cij;
+}
+
+int new_core(void) {
+	core_count++;
+	cores[core_count].parent = core_count;
+	cores[core_count].touch_id = 0;
+	cores[core_count].first_seed = -1;
+	init_area(&cores[core_count].area);
+	return core_count;
+}
+
+int join_cores(int label1, int label2) {
+	// Two labels turned out to be part of the same core, the higher root
+	// label is merged into the lower one.
+	int root1 = find_core(label1), root2 = find_core(label2), tmp;
+
+	if (root1 == root2)
+		return root1;
+	if (root2 < root1) {
+		tmp = root1;
+		root1 = root2;
+		root2 = tmp;
 	}
-	if (i < X_AXIS_MINUS1 && j > 0 && invalid_matrix[i+1][j-1] != cur_touch_id)
-	{
-		if (matrix[i+1][j-1] >= LARGE_AREA_FRINGE &&
-			matrix[i+1][j-1] < matrix[i][j])
-			determine_area_loc_fringe(isum, jsum, tweight, i + 1, j - 1,
-				cur_touch_id);
+	cores[root2].parent = root1;
+	merge_area(&cores[root1].area, &cores[root2].area);
+	if (cores[root1].first_seed < 0 ||
+		(cores[root2].first_seed >= 0 &&
+		cores[root2].first_seed < cores[root1].first_seed))
+		cores[root1].first_seed = cores[root2].first_seed;
+	return root1;
+}
+
+void start_labeling(void) {
+	int level;
+
+	core_count = 0;
+	fringe_seed_count = 0;
+	for (level=0; level<FRINGE_LEVELS; level++)
+		fringe_head[level] = -1;
+}
+
+void label_row(int i) {
+	// First pass: label the core points of row i and add them to the running
+	// totals of their core. A point takes the label of the point above it
+	// if there is one, as that point already touches the other neighbors we
+	// look at. Otherwise it joins up with the points to its left and above.
+	// Fringe points are sorted by value for later.
+	int j, label, cell;
+	unsigned char value;
+	unsigned short *labels = core_label[i];
+	unsigned short *above = i > 0 ? core_label[i-1] : NULL;
+
+	memset(labels, 0, sizeof(core_label[i]));
+	for (j=0; j<Y_AXIS_POINTS; j++) {
+		value = LEVEL(i, j);
+		if (value < large_area_fringe)
+			continue;
+		if (value < LARGE_AREA_UNPRESS) {
+			cell = MATRIX_INDEX(i, j);
+			fringe[i][j].owners = 0;
+			fringe[i][j].touches = 0;
+			fringe_next[cell] = fringe_head[value - large_area_fringe];
+			fringe_head[value - large_area_fringe] = cell;
+			if (value > touch_continue_thresh)
+				fringe_seeds[fringe_seed_count++] = cell;
+			continue;
+		}
+		if (above && above[j]) {
+			label = find_core(above[j]);
+		} else if (above && j < Y_AXIS_MINUS1 && above[j+1]) {
+			label = above[j+1];
+			if (j > 0 && labels[j-1])
+				label = join_cores(label, labels[j-1]);
+			else if (j > 0 && above[j-1])
+				label = join_cores(label, above[j-1]);
+			else
+				label = find_core(label);
+		} else if (j > 0 && labels[j-1]) {
+			label = find_core(labels[j-1]);
+		} else if (above && j > 0 && above[j-1]) {
+			label = find_core(above[j-1]);
+		} else {
+			label = new_core();
+		}
+		labels[j] = label;
+		add_area_cell(&cores[label].area, i, j);
+		// Points are visited in order so the first seed of a core can only
+		// be set once, unless another core is joined to it.
+		if (value > touch_continue_thresh && cores[label].first_seed < 0)
+			cores[label].first_seed = MATRIX_INDEX(i, j);
 	}
-	if (j < Y_AXIS_MINUS1 && i > 0 && invalid_matrix[i-1][j+1] != cur_touch_id)
-	{
-		if (matrix[i-1][j+1] >= LARGE_AREA_FRINGE &&
-			matrix[i-1][j+1] < matrix[i][j])
-			determine_area_loc_fringe(isum, jsum, tweight, i - 1, j + 1,
-				cur_touch_id);
+}
+
+#if BASELINE_FILTER
+void init_baseline(void) {
+	int i, j;
+
+	for (i=0; i<X_AXIS_POINTS; i++)
+		for (j=0; j<Y_AXIS_POINTS; j++) {
+			baseline[i][j] = 0;
+			noise_var[i][j] = 0;
+			noise_gain[i][j] = 256;
+		}
+	baseline_frames = 0;
+}
+
+void baseline_row(int i) {
+	// Replaces row i of the matrix with how far each value is above its
+	// baseline, and sets up the same row of the levels scaled by the noise
+	// of the point
+	int j, above, value;
+
+	memcpy(raw_matrix[i], matrix[i], Y_AXIS_POINTS);
+	for (j=0; j<Y_AXIS_POINTS; j++) {
+		above = (raw_matrix[i][j] << 8) - baseline[i][j];
+		value = (above + 128) >> 8;
+		matrix[i][j] = value < 0 ? 0 : MIN(value, 255);
+		value = (above * noise_gain[i][j]) >> 16;
+		level[i][j] = value < 0 ? 0 : MIN(value, 255);
 	}
-	if (j < Y_AXIS_MINUS1 && i < X_AXIS_MINUS1 &&
-		invalid_matrix[i+1][j+1] != cur_touch_id)
-	{
-		if (matrix[i+1][j+1] >= LARGE_AREA_FRINGE &&
-			matrix[i+1][j+1] < matrix[i][j])
-			determine_area_loc_fringe(isum, jsum, tweight, i + 1, j + 1,
-				cur_touch_id);
+}
+
+unsigned int isqrt(unsigned int value) {
+	// Square root rounded down, one bit at a time
+	unsigned int root = 0, bit = 1U << 30;
+
+	while (bit > value)
+		bit >>= 2;
+	while (bit) {
+		if (value >= root + bit) {
+			value -= root + bit;
+			root = (root >> 1) + bit;
+		} else {
+			root >>= 1;
+		}
+		bit >>= 2;
 	}
+	return root;
 }
 
-void determine_area_loc(float *isum, float *jsum, int *tweight, int i, int j,
-	int *mini, int *maxi, int *minj, int *maxj, int cur_touch_id,
-	int *highest_val){
-	float powered;
+void track_baseline(void) {
+	// Moves the baseline slowly toward a frame with touches, except where
+	// the touches are. The noise is left as it is, the touches would only
+	// add to it.
+	int i, j;
 
-	// Invalidate this touch point so that we don't process it later
-	invalid_matrix[i][j] = cur_touch_id;
+	for (i=0; i<X_AXIS_POINTS; i++)
+		for (j=0; j<Y_AXIS_POINTS; j++)
+			if (LEVEL(i, j) < large_area_fringe)
+				baseline[i][j] += ((raw_matrix[i][j] << 8) -
+					baseline[i][j]) / (1 << BASELINE_SLOW_SHIFT);
+}
 
-	// Track the size of the touch for TOUCH_MAJOR
-	if (i < *mini)
-		*mini = i;
-	if (i > *maxi)
-		*maxi = i;
-	if (j < *minj)
-		*minj = j;
-	if (j > *maxj)
-		*maxj = j;
+void update_baseline(void) {
+	// Learns from a frame without touches. The first frames are averaged
+	// evenly whether there are touches or not, the baseline can't tell
+	// touches apart before it has learned. After that the baseline and the
+	// variance are moving averages.
+	int i, j, value, delta;
+	int frames = MIN(baseline_frames + 1, 1 << BASELINE_SHIFT);
 
-	// Track the highest value of the touch to determine which threshold
-	// applies.
-	if (matrix[i][j] > *highest_val)
-		*highest_val = matrix[i][j];
+	for (i=0; i<X_AXIS_POINTS; i++)
+		for (j=0; j<Y_AXIS_POINTS; j++) {
+			value = raw_matrix[i][j] << 8;
+			delta = value - baseline[i][j];
+			// Variances have 8 fractional bits, (delta >> 4)^2 keeps
+			// that and fits in an int
+			if (baseline_frames >= 1 << BASELINE_SHIFT && delta > 0 &&
+				(delta >> 4) * (delta >> 4) > BASELINE_TOUCH_SIGMAS *
+				BASELINE_TOUCH_SIGMAS * MAX(noise_var[i][j], 256 *
+				NOISE_FLOOR * NOISE_FLOOR))
+				continue;
+			baseline[i][j] += delta / frames;
+			noise_var[i][j] += ((delta >> 4) *
+				((value - baseline[i][j]) >> 4) - noise_var[i][j]) /
+				frames;
+			// The square root of the variance is the noise with 4
+			// fractional bits
+			noise_gain[i][j] = NOISE_REF * 256 * 16 /
+				MAX(isqrt(MAX(noise_var[i][j], 0)), NOISE_FLOOR * 16);
+		}
+	if (baseline_frames < 1 << BASELINE_SHIFT)
+		baseline_frames++;
+#if BASELINE_DEBUG
+	for (i=0; i < X_AXIS_POINTS; i++) {
+		for (j=0; j < Y_AXIS_POINTS; j++)
+			printf("%2i/%-2i ", baseline[i][j] >> 8,
+				isqrt(MAX(noise_var[i][j], 0)) >> 4);
+		printf("|\n");
+	}
+	printf("end of baseline\n");
+#endif
+}
+#endif
 
-	// Track touch values to help determine the pixel x, y location
-	powered = pow(matrix[i][j], 1.5);
-	*tweight += powered;
-	*isum += powered * i;
-	*jsum += powered * j;
-
-	// Check nearby points to see if they are above LARGE_AREA_UNPRESS
-	// or if they are above LARGE_AREA_FRINGE but the next nearby point is
-	// decreasing in value.  If the value is not decreasing and below
-	// LARGE_AREA_UNPRESS then we have 2 fingers pinched close together.
-	if (i > 0 && invalid_matrix[i-1][j] != cur_touch_id)
-	{
-		if (matrix[i-1][j] >= LARGE_AREA_UNPRESS)
-			determine_area_loc(isum, jsum, tweight, i - 1, j, mini, maxi, minj,
-			maxj, cur_touch_id, highest_val);
-		else if (matrix[i-1][j] >= LARGE_AREA_FRINGE &&
-			matrix[i-1][j] < matrix[i][j])
-			determine_area_loc_fringe(isum, jsum, tweight, i - 1, j,
-				cur_touch_id);
-	}
-	if (i < X_AXIS_MINUS1 && invalid_matrix[i+1][j] != cur_touch_id)
-	{
-		if (matrix[i+1][j] >= LARGE_AREA_UNPRESS)
-			determine_area_loc(isum, jsum, tweight, i + 1, j, mini, maxi, minj,
-			maxj, cur_touch_id, highest_val);
-		else if (matrix[i+1][j] >= LARGE_AREA_FRINGE &&
-			matrix[i+1][j] < matrix[i][j])
-			determine_area_loc_fringe(isum, jsum, tweight, i + 1, j,
-				cur_touch_id);
-	}
-	if (j > 0 && invalid_matrix[i][j-1] != cur_touch_id)
-	{
-		if (matrix[i][j-1] >= LARGE_AREA_UNPRESS)
-			determine_area_loc(isum, jsum, tweight, i, j - 1, mini, maxi, minj,
-				maxj, cur_touch_id, highest_val);
-		else if (matrix[i][j-1] >= LARGE_AREA_FRINGE &&
-			matrix[i][j-1] < matrix[i][j])
-			determine_area_loc_fringe(isum, jsum, tweight, i, j - 1,
-				cur_touch_id);
-	}
-	if (j < Y_AXIS_MINUS1 && invalid_matrix[i][j+1] != cur_touch_id)
-	{
-		if (matrix[i][j+1] >= LARGE_AREA_UNPRESS)
-			determine_area_loc(isum, jsum, tweight, i, j + 1, mini, maxi, minj,
-				maxj, cur_touch_id, highest_val);
-		else if (matrix[i][j+1] >= LARGE_AREA_FRINGE &&
-			matrix[i][j+1] < matrix[i][j])
-			determine_area_loc_fringe(isum, jsum, tweight, i, j + 1,
-				cur_touch_id);
-	}
-	if (i > 0 && j > 0 && invalid_matrix[i-1][j-1] != cur_touch_id)
-	{
-		if (matrix[i-1][j-1] >= LARGE_AREA_UNPRESS)
-			determine_area_loc(isum, jsum, tweight, i - 1, j - 1, mini, maxi,
-				minj, maxj, cur_touch_id, highest_val);
-		else if (matrix[i-1][j-1] >= LARGE_AREA_FRINGE &&
-			matrix[i-1][j-1] < matrix[i][j])
-			determine_area_loc_fringe(isum, jsum, tweight, i - 1, j - 1,
-				cur_touch_id);
-	}
-	if (i < X_AXIS_MINUS1 && j > 0 && invalid_matrix[i+1][j-1] != cur_touch_id)
-	{
-		if (matrix[i+1][j-1] >= LARGE_AREA_UNPRESS)
-			determine_area_loc(isum, jsum, tweight, i + 1, j - 1, mini, maxi,
-				minj, maxj, cur_touch_id, highest_val);
-		else if (matrix[i+1][j-1] >= LARGE_AREA_FRINGE &&
-			matrix[i+1][j-1] < matrix[i][j])
-			determine_area_loc_fringe(isum, jsum, tweight, i + 1, j - 1,
-				cur_touch_id);
-	}
-	if (j < Y_AXIS_MINUS1 && i > 0 && invalid_matrix[i-1][j+1] != cur_touch_id)
-	{
-		if (matrix[i-1][j+1] >= LARGE_AREA_UNPRESS)
-			determine_area_loc(isum, jsum, tweight, i - 1, j + 1, mini, maxi,
-				minj, maxj, cur_touch_id, highest_val);
-		else if (matrix[i-1][j+1] >= LARGE_AREA_FRINGE &&
-			matrix[i-1][j+1] < matrix[i][j])
-			determine_area_loc_fringe(isum, jsum, tweight, i - 1, j + 1,
-				cur_touch_id);
-	}
-	if (j < Y_AXIS_MINUS1 && i < X_AXIS_MINUS1 &&
-		invalid_matrix[i+1][j+1] != cur_touch_id)
-	{
-		if (matrix[i+1][j+1] >= LARGE_AREA_UNPRESS)
-			determine_area_loc(isum, jsum, tweight, i + 1, j + 1, mini, maxi,
-				minj, maxj, cur_touch_id, highest_val);
-		else if (matrix[i+1][j+1] >= LARGE_AREA_FRINGE &&
-			matrix[i+1][j+1] < matrix[i][j])
-			determine_area_loc_fringe(isum, jsum, tweight, i + 1, j + 1,
-				cur_touch_id);
+void stream_row(int row) {
+	// Called for each row as it is written into the matrix so that most of
+	// the labeling is done before the end of the frame arrives.
+	if (row == next_label_row) {
+		label_row(row);
+		next_label_row++;
+	} else if (row < next_label_row) {
+		// A row that was already labeled changed
+		next_label_row = -1;
 	}
 }
 
-void process_new_tpoint(struct touchpoint *t, int *tracking_id) {
-	// Handles setting up a brand new touch point
-	if (t->highest_val > touch_delay_thresh) {
-		t->tracking_id = *tracking_id;
-		*tracking_id += 1;
-		if (t->highest_val <= touch_initial_thresh)
-			t->touch_delay = touch_delay_count;
-	} else {
-		t->highest_val = 0;
+void finish_labeling(void) {
+	int i;
+
+	if (next_label_row < 0) {
+		start_labeling();
+		next_label_row = 0;
 	}
+	for (i=next_label_row; i<X_AXIS_POINTS; i++)
+		label_row(i);
+	// The next frame has to start with its first row to be labeled as it
+	// arrives
+	next_label_row = -1;
 }
 
-int calc_point(void)
-{
-	int i, j, k;
-	int tweight = 0;
-	int tpc = 0;
-	float isum = 0, jsum = 0;
-	float avgi, avgj;
-	static int previoustpc, tracking_id = 0;
-#if DEBOUNCE_FILTER
-	int new_debounce_touch = 0;
-	static int initialx, initialy;
-#endif
+void push_fringe(int i, int j, int owners) {
+	// Passes the touches of a point on to the fringe points next to it that
+	// have a lower value.
+	int ni, nj, limit = MIN(LEVEL(i, j), LARGE_AREA_UNPRESS);
 
-	if (tp[tpoint][0].x < -20) {
-		// We had a total liftoff
-		previoustpc = 0;
-#if DEBOUNCE_FILTER
-		new_debounce_touch = 1;
-#endif
-	} else {
-		// Re-assign array indexes
-		prev2tpoint = prevtpoint;
-		prevtpoint = tpoint;
-		tpoint++;
-		if (tpoint > 2)
-			tpoint = 0;
+	for (ni=MAX(i-1, 0); ni<=MIN(i+1, X_AXIS_MINUS1); ni++)
+		for (nj=MAX(j-1, 0); nj<=MIN(j+1, Y_AXIS_MINUS1); nj++)
+			if (LEVEL(ni, nj) >= large_area_fringe &&
+				LEVEL(ni, nj) < limit)
+				fringe[ni][nj].owners |= owners;
+}
+
+void claim_core(int root, struct touch_area *a, int touch_id) {
+	// Assigns a core to a touch and hands the touch down to the fringe
+	// around the core.
+	struct touch_area *core_area = &cores[root].area;
+	int i, j;
+
+	cores[root].touch_id = touch_id;
+	merge_area(a, core_area);
+	for (i=core_area->mini; i<=core_area->maxi; i++)
+		for (j=core_area->minj; j<=core_area->maxj; j++)
+			if (core_label[i][j] && find_core(core_label[i][j]) == root)
+				push_fringe(i, j, TOUCH_BIT(touch_id));
+}
+
+void add_fringe(struct touch_area *areas, int wanted) {
+	// Second pass: a fringe point is part of a touch if one of its
+	// neighbors with a higher value is. The fringe is visited from the
+	// highest value to the lowest so that all higher neighbors have passed
+	// their touches on before a point is checked. Fringe points may be
+	// shared by touches. Only the touches in the wanted mask are added.
+	int level, cell, i, j, owners, k, weight;
+
+	for (level=FRINGE_LEVELS - 1; level>=0; level--) {
+		for (cell=fringe_head[level]; cell>=0; cell=fringe_next[cell]) {
+			i = cell / Y_AXIS_POINTS;
+			j = cell % Y_AXIS_POINTS;
+			owners = fringe[i][j].owners & wanted & ~fringe[i][j].touches;
+			if (!owners)
+				continue;
+			fringe[i][j].touches |= owners;
+			push_fringe(i, j, owners);
+			weight = weight_table[matrix[i][j]];
+			for (k=0; owners; k++, owners >>= 1) {
+				if (owners & 1) {
+					areas[k].tweight +=
+						int_weight_table[matrix[i][j]];
+					areas[k].isum += weight * i;
+					areas[k].jsum += weight * j;
+				}
+			}
+		}
 	}
+}
 
-	// Scan the digitizer data and generate a list of touches
-	memset(&invalid_matrix, 0, sizeof(invalid_matrix));
-	for(i=0; i < X_AXIS_POINTS; i++) {
-		for(j=0; j < Y_AXIS_POINTS; j++) {
-#if RAW_DATA_DEBUG
-			if (matrix[i][j] < RAW_DATA_THRESHOLD)
-				printf("   ");
-			else
-				printf("%2.2X ", matrix[i][j]);
-#endif
-			if (tpc < MAX_TOUCH && matrix[i][j] > touch_continue_thresh &&
-				!invalid_matrix[i][j]) {
-
-				isum = 0;
-				jsum = 0;
-				tweight = 0;
-				int mini = i, maxi = i, minj = j, maxj = j;
-				int highest_val = matrix[i][j];
-				determine_area_loc(&isum, &jsum, &tweight, i, j, &mini,
-					&maxi, &minj, &maxj, tpc + 1, &highest_val);
-
-				avgi = isum / (float)tweight;
-				avgj = jsum / (float)tweight;
-				maxi = maxi - mini;
-				maxj = maxj - minj;
-
-				tp[tpoint][tpc].pw = tweight;
-				tp[tpoint][tpc].i = avgi;
-				tp[tpoint][tpc].j = avgj;
-				tp[tpoint][tpc].touch_major = MAX(maxi, maxj) *
-					PIXELS_PER_POINT;
-				tp[tpoint][tpc].tracking_id = -1;
-#if USE_B_PROTOCOL
-				tp[tpoint][tpc].slot = -1;
-#endif
-				tp[tpoint][tpc].prev_loc = -1;
+void place_tpoint(struct touchpoint *t) {
+	// Sets up the rest of a new touch point from its location in the
+	// matrix
+	t->tracking_id = -1;
+	t->slot = -1;
+	t->prev_loc = -1;
+	// Each pixel location is truncated as a whole, the same as the floating
+	// point math used to.
 #if USERSPACE_270_ROTATE
-				tp[tpoint][tpc].x = tp[tpoint][tpc].i * X_LOCATION_VALUE;
-				tp[tpoint][tpc].y = Y_RESOLUTION_MINUS1 - tp[tpoint][tpc].j *
-					Y_LOCATION_VALUE;
+	t->x = t->i * X_RESOLUTION / X_LOCATION_DIV;
+	t->y = ((Y_RESOLUTION_MINUS1) * Y_LOCATION_DIV - t->j * Y_RESOLUTION) /
+		Y_LOCATION_DIV;
 #else
-				tp[tpoint][tpc].x = X_RESOLUTION_MINUS1 - tp[tpoint][tpc].j *
-					X_LOCATION_VALUE;
-				tp[tpoint][tpc].y = Y_RESOLUTION_MINUS1 - tp[tpoint][tpc].i *
-					Y_LOCATION_VALUE;
+	t->x = ((X_RESOLUTION_MINUS1) * X_LOCATION_DIV - t->j * X_RESOLUTION) /
+		X_LOCATION_DIV;
+	t->y = ((Y_RESOLUTION_MINUS1) * Y_LOCATION_DIV - t->i * Y_RESOLUTION) /
+		Y_LOCATION_DIV;
 #endif // USERSPACE_270_ROTATE
-				// It is possible for x and y to be negative with the math
-				// above so we force them to 0 if they are negative.
-				if (tp[tpoint][tpc].x < 0)
-					tp[tpoint][tpc].x = 0;
-				if (tp[tpoint][tpc].y < 0)
-					tp[tpoint][tpc].y = 0;
-				tp[tpoint][tpc].unfiltered_x = tp[tpoint][tpc].x;
-				tp[tpoint][tpc].unfiltered_y = tp[tpoint][tpc].y;
-				tp[tpoint][tpc].highest_val = highest_val;
-				tp[tpoint][tpc].touch_delay = 0;
+	// It is possible for x and y to be negative with the math
+	// above so we force them to 0 if they are negative.
+	if (t->x < 0)
+		t->x = 0;
+	if (t->y < 0)
+		t->y = 0;
+	t->unfiltered_x = t->x;
+	t->unfiltered_y = t->y;
+	t->touch_delay = 0;
+	t->fit_value = 0;
+#if PREDICT_FILTER
+	t->pred_x = t->x << LOCATION_SHIFT;
+	t->pred_y = t->y << LOCATION_SHIFT;
+	t->vel_x = 0;
+	t->vel_y = 0;
+#endif
 #if HOVER_DEBOUNCE_FILTER
-				tp[tpoint][tpc].hover_x = tp[tpoint][tpc].x;
-				tp[tpoint][tpc].hover_y = tp[tpoint][tpc].y;
-				tp[tpoint][tpc].hover_delay = HOVER_DEBOUNCE_DELAY;
+	t->hover_x = t->x;
+	t->hover_y = t->y;
+	t->hover_delay = hover_debounce_delay;
 #endif
-				tpc++;
+}
+
+int is_palm(struct touch_area *a) {
+	// The variance along the long axis is the largest eigenvalue of the
+	// covariance of the core points. With n points and the sums scaled up
+	// by n, 2 * n^2 * variance = vi + vj + sqrt((vi - vj)^2 + 4 * vij^2),
+	// which is compared to the limit without taking the square root.
+	long long n = a->cells, vi, vj, vij, over;
+
+	if (n < 2)
+		return 0;
+	if (n >= PALM_AREA)
+		return 1;
+	if (n >= PALM_FLAT_AREA &&
+		a->highest_weight * PALM_FLAT_RATIO < a->tweight)
+		return 1;
+	vi = n * a->cii - (long long)a->ci * a->ci;
+	vj = n * a->cjj - (long long)a->cj * a->cj;
+	vij = n * a->cij - (long long)a->ci * a->cj;
+	over = 2 * PALM_LENGTH_SQ * n * n - vi - vj;
+	return over <= 0 || (vi - vj) * (vi - vj) + 4 * vij * vij >= over * over;
+}
+
+void set_tpoint(struct touchpoint *t, struct touch_area *a) {
+	// Sets up the touch point for a newly found touch area
+	int div = a->tweight << WEIGHT_SHIFT;
+
+	t->pw = a->tweight;
+	// Rounded to the nearest fraction of a point
+	t->i = (((long long)a->isum << LOCATION_SHIFT) + div / 2) / div;
+	t->j = (((long long)a->jsum << LOCATION_SHIFT) + div / 2) / div;
+	t->touch_major = MAX(a->maxi - a->mini, a->maxj - a->minj) *
+		pixels_per_point;
+	t->highest_val = a->highest_val;
+	t->palm = PALM_REJECT && is_palm(a);
+	place_tpoint(t);
+}
+
+int find_touches(void) {
+	// Every point above touch_continue_thresh that isn't part of a touch
+	// yet starts a new touch, in the same order as scanning the matrix.
+	// Those points are the first seed of each core and, when
+	// touch_continue_thresh is below LARGE_AREA_UNPRESS, fringe points.
+	int i, j, ni, nj, root, seed, k, tpc = 0;
+	int root_count = 0, next_root = 0, next_fringe = 0;
+	unsigned short roots[MAX_CORES];
+	struct touch_area areas[MAX_TOUCH];
+
+	// Order the cores by first seed. Cores are created in scan order so the
+	// list is close to sorted already.
+	for (root=1; root<=core_count; root++) {
+		if (cores[root].parent != root || cores[root].first_seed < 0)
+			continue;
+		for (k=root_count; k>0 &&
+			cores[roots[k-1]].first_seed > cores[root].first_seed; k--)
+			roots[k] = roots[k-1];
+		roots[k] = root;
+		root_count++;
+	}
+
+	while (tpc < MAX_TOUCH &&
+		(next_root < root_count || next_fringe < fringe_seed_count)) {
+		if (next_fringe >= fringe_seed_count || (next_root < root_count &&
+			cores[roots[next_root]].first_seed <
+			fringe_seeds[next_fringe])) {
+			root = roots[next_root++];
+			if (cores[root].touch_id)
+				continue;
+			init_area(&areas[tpc]);
+			claim_core(root, &areas[tpc], tpc + 1);
+		} else {
+			// A fringe point only starts a touch if the fringe of an
+			// earlier touch doesn't cover it. It acts as a core point and
+			// pulls in any cores next to it.
+			seed = fringe_seeds[next_fringe++];
+			i = seed / Y_AXIS_POINTS;
+			j = seed % Y_AXIS_POINTS;
+			if (fringe[i][j].touches)
+				continue;
+			fringe[i][j].touches = TOUCH_BIT(tpc + 1);
+			init_area(&areas[tpc]);
+			add_area_cell(&areas[tpc], i, j);
+			push_fringe(i, j, TOUCH_BIT(tpc + 1));
+			for (ni=MAX(i-1, 0); ni<=MIN(i+1, X_AXIS_MINUS1); ni++) {
+				for (nj=MAX(j-1, 0); nj<=MIN(j+1, Y_AXIS_MINUS1); nj++) {
+					if (LEVEL(ni, nj) < LARGE_AREA_UNPRESS)
+						continue;
+					root = find_core(core_label[ni][nj]);
+					if (!cores[root].touch_id)
+						claim_core(root, &areas[tpc], tpc + 1);
+				}
 			}
 		}
-#if RAW_DATA_DEBUG
-		printf(" |\n"); // end of row
-#endif
+		// With fringe seeds around the fringe has to be settled touch by
+		// touch, otherwise it is done for all touches at once below.
+		if (fringe_seed_count)
+			add_fringe(areas, TOUCH_BIT(tpc + 1));
+		tpc++;
 	}
-#if RAW_DATA_DEBUG
-	printf("end of raw data\n"); // helps separate one frame from the next
-#endif
+	if (!fringe_seed_count)
+		add_fringe(areas, TOUCH_BIT(tpc + 1) - 1);
 
-#if USE_B_PROTOCOL
-	// Set all previously used slots to -1 so we know if we need to lift any
-	// of them off after matching
-	for (i=0; i<MAX_TOUCH; i++)
-		if(slot_in_use[i])
-			slot_in_use[i] = -1;
-#endif
+	for (k=0; k<tpc; k++)
+		set_tpoint(&tp[tpoint][k], &areas[k]);
+	return tpc;
+}
+
+int find_flood_touches(void) {
+	finish_labeling();
+	return find_touches();
+}
+
+struct peak {
+	int value;
+	int i;
+	int j;
+	int fit; // Index of its fit job, -1 if it isn't fitted
+	int fit_member; // Which of the peaks of the fit job it is
+	int nearest; // Squared distance to the nearest other peak
+};
+
+#ifdef __ARM_NEON__
+static uint8x16_t peak_mask(uint8x16_t value, uint8x16_t level,
+	uint8x16_t above, uint8x16_t here, uint8x16_t below, uint8x16_t thresh) {
+	// Lanes at least as high as the highest of the three row maximums
+	// around them with a level above the threshold
+	uint8x16_t highest = vmaxq_u8(vmaxq_u8(above, here), below);
+
+	return vandq_u8(vcgeq_u8(value, highest), vcgtq_u8(level, thresh));
+}
+
+static unsigned int peak_bits(uint8x16_t mask) {
+	// Packs the 16 lanes of a mask into one bit each
+	static const unsigned char weights[16] = {
+		1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128
+	};
+	uint8x16_t bits = vandq_u8(mask, vld1q_u8(weights));
+	uint8x8_t sum = vpadd_u8(vget_low_u8(bits), vget_high_u8(bits));
+
+	sum = vpadd_u8(sum, sum);
+	sum = vpadd_u8(sum, sum);
+	return vget_lane_u16(vreinterpret_u16_u8(sum), 0);
+}
+
+void find_peak_candidates(unsigned long long *candidates) {
+	// Separable 3x3 max filter: the maximum of each point and its left and
+	// right neighbours first, then the maximum of those over the rows
+	// above and below. Points outside the matrix count as 0. Only points
+	// with a level above the threshold are candidates.
+	unsigned char row[PEAK_ROW_BYTES], levels[PEAK_ROW_BYTES];
+	unsigned char rowmax[X_AXIS_POINTS + 2][PEAK_ROW_BYTES];
+	uint8x16_t zero = vdupq_n_u8(0), v0, v1, v2, thresh;
+	uint8x16_t a0, a1, a2, h0, h1, h2, b0, b1, b2;
+	int i;
+
+	memset(row, 0, sizeof(row));
+	memset(levels, 0, sizeof(levels));
+	memset(rowmax[0], 0, PEAK_ROW_BYTES);
+	memset(rowmax[X_AXIS_POINTS + 1], 0, PEAK_ROW_BYTES);
+	for (i=0; i<X_AXIS_POINTS; i++) {
+		memcpy(row, matrix[i], Y_AXIS_POINTS);
+		v0 = vld1q_u8(row);
+		v1 = vld1q_u8(row + 16);
+		v2 = vld1q_u8(row + 32);
+		vst1q_u8(rowmax[i + 1], vmaxq_u8(vmaxq_u8(vextq_u8(zero, v0, 15),
+			v0), vextq_u8(v0, v1, 1)));
+		vst1q_u8(rowmax[i + 1] + 16, vmaxq_u8(vmaxq_u8(vextq_u8(v0, v1, 15),
+			v1), vextq_u8(v1, v2, 1)));
+		vst1q_u8(rowmax[i + 1] + 32, vmaxq_u8(vmaxq_u8(vextq_u8(v1, v2, 15),
+			v2), vextq_u8(v2, zero, 1)));
+	}
+
+	thresh = vdupq_n_u8(MAX(MIN(touch_continue_thresh, 255), 0));
+	a0 = vld1q_u8(rowmax[0]);
+	a1 = vld1q_u8(rowmax[0] + 16);
+	a2 = vld1q_u8(rowmax[0] + 32);
+	h0 = vld1q_u8(rowmax[1]);
+	h1 = vld1q_u8(rowmax[1] + 16);
+	h2 = vld1q_u8(rowmax[1] + 32);
+	for (i=0; i<X_AXIS_POINTS; i++) {
+		memcpy(row, matrix[i], Y_AXIS_POINTS);
+		memcpy(levels, LEVEL_ROW(i), Y_AXIS_POINTS);
+		b0 = vld1q_u8(rowmax[i + 2]);
+		b1 = vld1q_u8(rowmax[i + 2] + 16);
+		b2 = vld1q_u8(rowmax[i + 2] + 32);
+		candidates[i] = peak_bits(peak_mask(vld1q_u8(row),
+			vld1q_u8(levels), a0, h0, b0, thresh)) |
+			(unsigned long long)peak_bits(peak_mask(vld1q_u8(row + 16),
+			vld1q_u8(levels + 16), a1, h1, b1, thresh)) << 16 |
+			(unsigned long long)peak_bits(peak_mask(vld1q_u8(row + 32),
+			vld1q_u8(levels + 32), a2, h2, b2, thresh)) << 32;
+		a0 = h0; a1 = h1; a2 = h2;
+		h0 = b0; h1 = b1; h2 = b2;
+	}
+}
+#else
+void find_peak_candidates(unsigned long long *candidates) {
+	// Separable 3x3 max filter: the maximum of each point and its left and
+	// right neighbours first, then the maximum of those over the rows
+	// above and below. Points outside the matrix count as 0. Only points
+	// with a level above the threshold are candidates.
+	unsigned char rowmax[X_AXIS_POINTS + 2][Y_AXIS_POINTS];
+	int i, j, highest;
+
+	memset(rowmax[0], 0, Y_AXIS_POINTS);
+	memset(rowmax[X_AXIS_POINTS + 1], 0, Y_AXIS_POINTS);
+	for (i=0; i<X_AXIS_POINTS; i++) {
+		for (j=0; j<Y_AXIS_POINTS; j++) {
+			highest = matrix[i][j];
+			if (j > 0)
+				highest = MAX(highest, matrix[i][j - 1]);
+			if (j < Y_AXIS_MINUS1)
+				highest = MAX(highest, matrix[i][j + 1]);
+			rowmax[i + 1][j] = highest;
+		}
+	}
+
+	for (i=0; i<X_AXIS_POINTS; i++) {
+		candidates[i] = 0;
+		for (j=0; j<Y_AXIS_POINTS; j++) {
+			highest = MAX(MAX(rowmax[i][j], rowmax[i + 1][j]),
+				rowmax[i + 2][j]);
+			if (matrix[i][j] >= highest &&
+				LEVEL(i, j) > touch_continue_thresh)
+				candidates[i] |= 1ULL << j;
+		}
+	}
+}
+#endif
+
+void add_peak(struct peak *peaks, int count, int i, int j) {
+	// Keeps the peaks sorted strongest first, peaks of the same strength
+	// stay in scan order
+	int value = matrix[i][j];
+
+	for (; count > 0 && peaks[count - 1].value < value; count--)
+		peaks[count] = peaks[count - 1];
+	peaks[count].value = value;
+	peaks[count].i = i;
+	peaks[count].j = j;
+}
+
+void peak_window(struct peak *p, int radius, int *mini, int *minj) {
+	// Top left corner of the square of points within radius of the peak,
+	// moved so that all of it is inside the matrix
+	*mini = MIN(MAX(p->i - radius, 0), X_AXIS_POINTS - 1 - 2 * radius);
+	*minj = MIN(MAX(p->j - radius, 0), Y_AXIS_POINTS - 1 - 2 * radius);
+}
+
+void add_peak_area(struct touch_area *a, struct peak *peaks, int peak_count,
+	int k) {
+	// The center is the weighted average of all of the points around the
+	// peak. The size and shape only come from the core points that are
+	// connected to the peak and nearer to it than to any other peak, so
+	// fingers close by don't make the touch look like a palm.
+	struct peak *p = &peaks[k];
+	unsigned int owned[2 * PEAK_AVG_RADIUS + 1];
+	unsigned int reach[2 * PEAK_AVG_RADIUS + 1], grow;
+	int i, j, l, mini, minj, di, dj, dist, changed;
+
+	peak_window(p, PEAK_AVG_RADIUS, &mini, &minj);
+	for (i=0; i<=2 * PEAK_AVG_RADIUS; i++) {
+		owned[i] = 0;
+		reach[i] = 0;
+		for (j=0; j<=2 * PEAK_AVG_RADIUS; j++) {
+			if (LEVEL(mini + i, minj + j) < LARGE_AREA_UNPRESS)
+				continue;
+			di = mini + i - p->i;
+			dj = minj + j - p->j;
+			dist = di * di + dj * dj;
+			// Peaks next to this one are part of the same touch
+			for (l=0; l<peak_count; l++) {
+				if (abs(peaks[l].i - p->i) < PEAK_RADIUS &&
+					abs(peaks[l].j - p->j) < PEAK_RADIUS)
+					continue;
+				di = mini + i - peaks[l].i;
+				dj = minj + j - peaks[l].j;
+				if (di * di + dj * dj <= dist)
+					break;
+			}
+			if (l == peak_count)
+				owned[i] |= 1 << j;
+		}
+	}
+	// Grow out from the peak through the owned points
+	reach[p->i - mini] = 1 << (p->j - minj);
+	do {
+		changed = 0;
+		for (i=0; i<=2 * PEAK_AVG_RADIUS; i++) {
+			grow = reach[i];
+			if (i > 0)
+				grow |= reach[i - 1];
+			if (i < 2 * PEAK_AVG_RADIUS)
+				grow |= reach[i + 1];
+			grow = (grow | grow << 1 | grow >> 1) & owned[i];
+			if (grow & ~reach[i]) {
+				reach[i] |= grow;
+				changed = 1;
+			}
+		}
+	} while (changed);
+
+	init_area(a);
+	for (i=0; i<=2 * PEAK_AVG_RADIUS; i++) {
+		for (j=0; j<=2 * PEAK_AVG_RADIUS; j++) {
+			if (reach[i] & 1 << j)
+				add_area_cell(a, mini + i, minj + j);
+			else
+				add_area_weight(a, mini + i, minj + j);
+		}
+	}
+}
+
+// Fits done by the peak detector and the iterations they took, split up by
+// how they were started. Each thread doing fits counts its own.
+struct fit_counts {
+	unsigned int cold_fits;
+	unsigned int cold_iterations;
+	unsigned int warm_fits;
+	unsigned int warm_iterations;
+	// Warm started fits that went wrong and were done again
+	unsigned int warm_retries;
+	// Peaks fitted together, and the ones that had to be fitted one by
+	// one after all
+	unsigned int joint_fits;
+	unsigned int joint_iterations;
+	unsigned int joint_failures;
+} fit_stats[FIT_WORKERS + 1];
+
+// Center of the fit of a peak in fractions of a point. fitted is -1 if
+// the fit wandered out of the window.
+struct fit_center {
+	int fitted;
+	int i;
+	int j;
+	float value;
+};
+// Peaks that are fitted together, strongest first, and the fit of each
+// once done is set. joint is set if they were told apart by the joint fit.
+struct fit_job {
+	struct peak *p[FIT_MAX_GAUSSIANS];
+	struct fit_center c[FIT_MAX_GAUSSIANS];
+	int count;
+	int done;
+	int joint;
+};
+struct fit_job fit_jobs[MAX_PEAKS];
+int fit_job_count;
+// Next job to be taken by any of the threads doing the fits
+int fit_next_job;
+// The workers are started by start_fit_workers() once the peak detector
+// is in use. Each one adds itself to fit_workers_running.
+int fit_workers_wanted;
+int fit_workers_started;
+int fit_workers_pinned;
+// Protects the fields below, fit_generation goes up each time the workers
+// are given jobs and fit_workers_busy counts down as they finish
+pthread_mutex_t fit_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t fit_start = PTHREAD_COND_INITIALIZER;
+pthread_cond_t fit_done = PTHREAD_COND_INITIALIZER;
+unsigned int fit_generation;
+int fit_workers_running;
+int fit_workers_busy;
+// Each thread fits in its own levmar memory, 0 is the processing thread
+struct levmar_ctx fit_ctx[FIT_WORKERS + 1];
+
+struct touchpoint *fitted_prev_touch(struct peak *p) {
+	// Returns the fitted touch of the last frame that is closest to the
+	// peak, if it is within PEAK_RADIUS points
+	struct touchpoint *prev, *nearest = NULL;
+	int k, di, dj, distance, nearest_distance = INT_MAX;
+
+	if (!PEAK_FIT_WARM)
+		return NULL;
+	for (k=0; k<previoustpc; k++) {
+		prev = &tp[prevtpoint][k];
+		di = prev->i - (p->i << LOCATION_SHIFT);
+		dj = prev->j - (p->j << LOCATION_SHIFT);
+		distance = MAX(abs(di), abs(dj));
+		if (prev->fit_value > 0 && distance < nearest_distance) {
+			nearest = prev;
+			nearest_distance = distance;
+		}
+	}
+	return nearest_distance < PEAK_RADIUS << LOCATION_SHIFT ? nearest : NULL;
+}
+
+void fit_guess(struct peak *p, struct touchpoint *prev, float *guess) {
+	// Starting height and center in points of the matrix for the fit of a
+	// peak
+	int center_i, center_j;
+
+	if (prev) {
+		// The fit of the last frame moved on by as much as the touch moved
+		// between the two frames before
+		center_i = prev->i;
+		center_j = prev->j;
+		if (prev->prev_loc >= 0 &&
+			tp[prev2tpoint][prev->prev_loc].fit_value > 0) {
+			center_i += prev->i - tp[prev2tpoint][prev->prev_loc].i;
+			center_j += prev->j - tp[prev2tpoint][prev->prev_loc].j;
+		}
+		guess[0] = prev->fit_value;
+		guess[1] = (float)center_i / (1 << LOCATION_SHIFT);
+		guess[2] = (float)center_j / (1 << LOCATION_SHIFT);
+	} else {
+		guess[0] = p->value;
+		guess[1] = p->i;
+		guess[2] = p->j;
+	}
+}
+
+void fit_peak(struct fit_job *job, int member, int worker) {
+	// Finds the center of a Gaussian fitted to the points around one peak.
+	// worker is the thread doing the fit, 0 for the processing thread.
+	struct fit_counts *stats = &fit_stats[worker];
+	struct fit_center *c = &job->c[member];
+	struct peak *p = job->p[member];
+#if PEAK_FIT_LEVMAR
+	double window[(2 * PEAK_FIT_RADIUS + 1) * (2 * PEAK_FIT_RADIUS + 1)];
+	double guess[3], offset[2];
+#else
+	float window[(2 * PEAK_FIT_RADIUS + 1) * (2 * PEAK_FIT_RADIUS + 1)];
+	float guess[3], *offset = &guess[1];
+#endif
+	struct touchpoint *prev = fitted_prev_touch(p);
+	float start[3];
+	int k, l, mini, minj, n = 0, iterations;
+
+	peak_window(p, PEAK_FIT_RADIUS, &mini, &minj);
+	for (k=mini; k<=mini + 2 * PEAK_FIT_RADIUS; k++)
+		for (l=minj; l<=minj + 2 * PEAK_FIT_RADIUS; l++)
+			window[n++] = matrix[k][l];
+	while (1) {
+		// From the peak, which is not in the middle of the window near
+		// the edges, or from the last frame
+		fit_guess(p, prev, start);
+		guess[0] = start[0];
+		guess[1] = start[1] - mini - PEAK_FIT_RADIUS;
+		guess[2] = start[2] - minj - PEAK_FIT_RADIUS;
+#if PEAK_FIT_LEVMAR
+		iterations = runlm(&fit_ctx[worker], PEAK_FIT_RADIUS, guess, window,
+			offset);
+#else
+		iterations = fit_gaussian(PEAK_FIT_RADIUS, guess, window);
+#endif
+		// Written so that a NaN fails too
+		if (fabs(offset[0]) <= PEAK_FIT_RADIUS &&
+			fabs(offset[1]) <= PEAK_FIT_RADIUS && guess[0] > 0)
+			break;
+		if (!prev)
+			break;
+		// Diverged from the warm start, go again from the peak
+		stats->warm_retries++;
+		stats->warm_iterations += iterations;
+		prev = NULL;
+	}
+	if (prev) {
+		stats->warm_fits++;
+		stats->warm_iterations += iterations;
+	} else {
+		stats->cold_fits++;
+		stats->cold_iterations += iterations;
+	}
+
+	c->fitted = fabs(offset[0]) <= PEAK_FIT_RADIUS &&
+		fabs(offset[1]) <= PEAK_FIT_RADIUS ? 1 : -1;
+	c->i = (mini + PEAK_FIT_RADIUS + offset[0]) * (1 << LOCATION_SHIFT) + 0.5;
+	c->j = (minj + PEAK_FIT_RADIUS + offset[1]) * (1 << LOCATION_SHIFT) + 0.5;
+	c->value = guess[0];
+}
+
+void joint_window(struct fit_job *job, int count, int *mini, int *minj,
+	int *rows, int *cols) {
+	// Window of the points within PEAK_FIT_RADIUS of the first count peaks
+	// of the job, cut off at the edges of the matrix
+	int k, maxi, maxj;
+
+	*mini = maxi = job->p[0]->i;
+	*minj = maxj = job->p[0]->j;
+	for (k=1; k<count; k++) {
+		*mini = MIN(*mini, job->p[k]->i);
+		*minj = MIN(*minj, job->p[k]->j);
+		maxi = MAX(maxi, job->p[k]->i);
+		maxj = MAX(maxj, job->p[k]->j);
+	}
+	*mini = MAX(*mini - PEAK_FIT_RADIUS, 0);
+	*minj = MAX(*minj - PEAK_FIT_RADIUS, 0);
+	*rows = MIN(maxi + PEAK_FIT_RADIUS, X_AXIS_MINUS1) - *mini + 1;
+	*cols = MIN(maxj + PEAK_FIT_RADIUS, Y_AXIS_MINUS1) - *minj + 1;
+}
+
+int fit_joint(struct fit_job *job, int worker) {
+	// Fits all of the peaks of the job together, starting from the last
+	// frame where that is possible. Returns 0 if the Gaussians wandered
+	// out of the window or onto each other.
+	struct fit_counts *stats = &fit_stats[worker];
+	struct touchpoint *prev;
+	float window[FIT_JOINT_MAX_SIZE * FIT_JOINT_MAX_SIZE];
+	float p[3 * FIT_MAX_GAUSSIANS], di, dj;
+	int k, l, mini, minj, rows, cols, n = 0, warm = 1, used_prev, good;
+
+	joint_window(job, job->count, &mini, &minj, &rows, &cols);
+	for (k=mini; k<mini + rows; k++)
+		for (l=minj; l<minj + cols; l++)
+			window[n++] = matrix[k][l];
+	while (1) {
+		used_prev = 0;
+		for (k=0; k<job->count; k++) {
+			prev = warm ? fitted_prev_touch(job->p[k]) : NULL;
+			used_prev |= prev != NULL;
+			fit_guess(job->p[k], prev, &p[3 * k]);
+			p[3 * k + 1] -= mini;
+			p[3 * k + 2] -= minj;
+		}
+		stats->joint_iterations += fit_gaussians(job->count, rows, cols, p,
+			window);
+
+		// Written so that a NaN fails too
+		good = 1;
+		for (k=0; k<job->count && good; k++) {
+			good = p[3 * k] > touch_continue_thresh && p[3 * k + 1] >= 0 &&
+				p[3 * k + 1] <= rows - 1 && p[3 * k + 2] >= 0 &&
+				p[3 * k + 2] <= cols - 1;
+			for (l=0; l<k && good; l++) {
+				di = p[3 * k + 1] - p[3 * l + 1];
+				dj = p[3 * k + 2] - p[3 * l + 2];
+				good = di * di + dj * dj >=
+					PEAK_JOINT_MIN_SEP * PEAK_JOINT_MIN_SEP;
+			}
+		}
+		if (good || !used_prev)
+			break;
+		// Went wrong from the last frame, go again from the peaks
+		warm = 0;
+	}
+	stats->joint_fits++;
+	if (!good) {
+		stats->joint_failures++;
+		return 0;
+	}
+	for (k=0; k<job->count; k++) {
+		job->c[k].fitted = 1;
+		job->c[k].i = (mini + p[3 * k + 1]) * (1 << LOCATION_SHIFT) + 0.5;
+		job->c[k].j = (minj + p[3 * k + 2]) * (1 << LOCATION_SHIFT) + 0.5;
+		job->c[k].value = p[3 * k];
+	}
+	return 1;
+}
+
+void fit_job(struct fit_job *job, int worker) {
+	// Fits the peaks of the job together if there are several, otherwise
+	// or if that didn't work, one by one
+	int k;
+
+	job->joint = job->count > 1 && fit_joint(job, worker);
+	if (!job->joint)
+		for (k=0; k<job->count; k++)
+			fit_peak(job, k, worker);
+	job->done = 1;
+}
+
+void fit_tpoint(struct touchpoint *t, struct peak *p) {
+	// Moves the touch to the center of the fit of its peak, fitting it
+	// first if that wasn't done up front
+	struct fit_job *job = &fit_jobs[p->fit];
+	struct fit_center *c = &job->c[p->fit_member];
+
+	if (!job->done)
+		fit_job(job, 0);
+	if (c->fitted < 0)
+		return;
+	t->i = c->i;
+	t->j = c->j;
+	place_tpoint(t);
+	t->fit_value = c->value;
+}
+
+void run_fit_jobs(int worker) {
+	// Takes jobs until there are none left
+	int k;
+
+	while ((k = __sync_fetch_and_add(&fit_next_job, 1)) < fit_job_count)
+		fit_job(&fit_jobs[k], worker);
+}
+
+void share_fit_jobs(void) {
+	// Does all of the fit jobs along with the fit workers and waits for
+	// them to finish
+	fit_next_job = 0;
+	pthread_mutex_lock(&fit_lock);
+	fit_generation++;
+	fit_workers_busy = fit_workers_running;
+	pthread_cond_broadcast(&fit_start);
+	pthread_mutex_unlock(&fit_lock);
+	run_fit_jobs(0);
+	pthread_mutex_lock(&fit_lock);
+	while (fit_workers_busy)
+		pthread_cond_wait(&fit_done, &fit_lock);
+	pthread_mutex_unlock(&fit_lock);
+}
+
+void fit_peaks(void) {
+	// When there are enough fit jobs to share out they are all done now,
+	// with the help of the fit workers. Otherwise each one is done by
+	// fit_tpoint() if its peak becomes a touch.
+	if (fit_job_count >= FIT_PARALLEL_MIN && fit_workers_running)
+		share_fit_jobs();
+}
+
+// Set while making an edge correction table. Every peak that isn't close
+// to another one is fitted, and its fit and weighted average are recorded.
+int edge_calibrating;
+
+void calibrate_edge(struct touchpoint *t, struct peak *p) {
+	// Fits a touch that is set up from the weighted average and records
+	// how far the fit moved it
+	struct fit_job *job = &fit_jobs[p->fit];
+	int raw_i = t->i, raw_j = t->j;
+
+	fit_tpoint(t, p);
+	if (job->count == 1 && job->c[0].fitted > 0 &&
+		p->nearest >= EDGE_CALIB_CLEAR_SQ)
+		edge_calib_add(raw_i, raw_j, t->i, t->j);
+}
+
+int joins_fit(struct fit_job *job, struct peak *p) {
+	// A peak is fitted along with the peaks of the job if it is close to
+	// the strongest of them, but not so close that it is the same touch,
+	// and the window around all of them stays small enough
+	int di = p->i - job->p[0]->i, dj = p->j - job->p[0]->j;
+	int mini, minj, rows, cols;
+
+	if (di * di + dj * dj >= PEAK_FIT_NEAR_SQ ||
+		MAX(abs(di), abs(dj)) < PEAK_RADIUS)
+		return 0;
+	job->p[job->count] = p;
+	joint_window(job, job->count + 1, &mini, &minj, &rows, &cols);
+	return rows <= FIT_JOINT_MAX_SIZE && cols <= FIT_JOINT_MAX_SIZE;
+}
+
+int areas_touch(struct touch_area *a, struct touch_area *b) {
+	// Set if the core points of the two areas are within one point of each
+	// other along both axes, going by their bounding boxes
+	return a->cells && b->cells &&
+		a->mini <= b->maxi + 1 && b->mini <= a->maxi + 1 &&
+		a->minj <= b->maxj + 1 && b->minj <= a->maxj + 1;
+}
+
+int find_peak_touches(void) {
+	// Peaks are taken strongest first. Each one that isn't next to a touch
+	// that was already found, or part of a palm that was, becomes a new
+	// touch.
+	struct peak peaks[MAX_PEAKS];
+	unsigned long long candidates[X_AXIS_POINTS];
+	struct touch_area a, palm_areas[MAX_TOUCH];
+	struct touchpoint *t;
+	struct fit_job *job;
+	int needs_fit[MAX_PEAKS], touch_fit[MAX_TOUCH], edge[MAX_PEAKS];
+	int i, j, k, l, di, dj, nearest;
+	int peak_count = 0, tpc = 0;
+
+	find_peak_candidates(candidates);
+	for (i=0; i<X_AXIS_POINTS && peak_count < MAX_PEAKS; i++) {
+		while (candidates[i] && peak_count < MAX_PEAKS) {
+			j = __builtin_ctzll(candidates[i]);
+			candidates[i] &= candidates[i] - 1;
+			add_peak(peaks, peak_count++, i, j);
+		}
+	}
+
+	// The weighted average is pulled toward the middle of the matrix near
+	// the edges and toward other touches close by, so those peaks are
+	// fitted instead. Near the edges the edge correction table does the
+	// same if one is loaded. The fits don't depend on each other, so they
+	// can be done before the touches are picked out.
+	for (k=0; k<peak_count; k++) {
+		// Squared distance to the nearest other peak
+		nearest = INT_MAX;
+		for (l=0; l<peak_count; l++) {
+			if (l == k)
+				continue;
+			di = peaks[l].i - peaks[k].i;
+			dj = peaks[l].j - peaks[k].j;
+			nearest = MIN(nearest, di * di + dj * dj);
+		}
+		edge[k] = peaks[k].i < PEAK_FIT_EDGE ||
+			peaks[k].j < PEAK_FIT_EDGE ||
+			peaks[k].i >= X_AXIS_POINTS - PEAK_FIT_EDGE ||
+			peaks[k].j >= Y_AXIS_POINTS - PEAK_FIT_EDGE;
+		peaks[k].nearest = nearest;
+		needs_fit[k] = nearest < PEAK_FIT_NEAR_SQ || edge_calibrating ||
+			(edge[k] && !(PEAK_EDGE_TABLE && edge_loaded()));
+		peaks[k].fit = -1;
+	}
+	fit_job_count = 0;
+	for (k=0; k<peak_count; k++) {
+		if (!needs_fit[k] || peaks[k].fit >= 0)
+			continue;
+		job = &fit_jobs[fit_job_count];
+		job->p[0] = &peaks[k];
+		job->count = 1;
+		job->done = 0;
+		job->joint = 0;
+		peaks[k].fit = fit_job_count;
+		peaks[k].fit_member = 0;
+		// Weaker peaks close by are fitted along with it
+		for (l=k + 1; PEAK_FIT_JOINT && l<peak_count &&
+			job->count<FIT_MAX_GAUSSIANS; l++) {
+			if (peaks[l].fit < 0 && joins_fit(job, &peaks[l])) {
+				peaks[l].fit = fit_job_count;
+				peaks[l].fit_member = job->count++;
+			}
+		}
+		fit_job_count++;
+	}
+	fit_peaks();
+
+	for (k=0; k<peak_count && tpc<MAX_TOUCH; k++) {
+		for (l=0; l<tpc; l++) {
+			// Peaks that were told apart by fitting them together are
+			// separate touches however close they are
+			if (peaks[k].fit >= 0 && touch_fit[l] == peaks[k].fit &&
+				fit_jobs[peaks[k].fit].joint)
+				continue;
+			t = &tp[tpoint][l];
+			if (abs(t->i - (peaks[k].i << LOCATION_SHIFT)) <
+				PEAK_RADIUS << LOCATION_SHIFT &&
+				abs(t->j - (peaks[k].j << LOCATION_SHIFT)) <
+				PEAK_RADIUS << LOCATION_SHIFT)
+				break;
+		}
+		if (l < tpc)
+			continue;
+
+		add_peak_area(&a, peaks, peak_count, k);
+		// The other peaks of a palm that was already found are part of it,
+		// so that one palm doesn't take up the touches fingers need
+		for (l=0; l<tpc; l++)
+			if (tp[tpoint][l].palm && areas_touch(&palm_areas[l], &a))
+				break;
+		if (l < tpc) {
+			palm_areas[l].mini = MIN(palm_areas[l].mini, a.mini);
+			palm_areas[l].maxi = MAX(palm_areas[l].maxi, a.maxi);
+			palm_areas[l].minj = MIN(palm_areas[l].minj, a.minj);
+			palm_areas[l].maxj = MAX(palm_areas[l].maxj, a.maxj);
+			continue;
+		}
+
+		touch_fit[tpc] = peaks[k].fit;
+		palm_areas[tpc] = a;
+		t = &tp[tpoint][tpc++];
+		set_tpoint(t, &a);
+		if (peaks[k].fit >= 0 && edge_calibrating) {
+			calibrate_edge(t, &peaks[k]);
+		} else if (peaks[k].fit >= 0) {
+			fit_tpoint(t, &peaks[k]);
+		} else if (edge[k]) {
+			// Peaks near the edge that aren't fitted are corrected
+			edge_correct(&t->i, &t->j);
+			place_tpoint(t);
+		}
+	}
+	return tpc;
+}
+
+// Each detector finds the touches in the matrix, sets them up in
+// tp[tpoint] with set_tpoint() and returns how many it found. Tracking,
+// filtering and sending the touches is the same for all of them. If
+// add_row is set it is called for each row as it arrives.
+struct detector {
+	const char *name;
+	int (*find_touches)(void);
+	void (*add_row)(int row);
+};
+
+struct detector detectors[] = {
+	{ "flood", find_flood_touches, stream_row },
+	{ "peak", find_peak_touches, NULL },
+};
+
+#define DETECTOR_COUNT ((int)(sizeof(detectors) / sizeof(detectors[0])))
+
+int find_detector(const char *name) {
+	int d;
+
+	for (d=0; d<DETECTOR_COUNT; d++)
+		if (!strcmp(detectors[d].name, name))
+			return d;
+	return -1;
+}
+
+// When benchmarking, the touches of each frame are also found with
+// compare_detector and matched up with the ones found by detector_type
+int compare_detector = -1;
+struct {
+	unsigned int frames;
+	// Frames where the number of touches found was different
+	unsigned int count_diffs;
+	// Touches that matched up and the distance between them in pixels
+	unsigned int matched;
+	double total_distance;
+	double max_distance;
+} detector_diffs;
+
+void compare_touches(struct touchpoint *ref, int ref_count, int tpc) {
+	int cost[ASSIGN_MAX][ASSIGN_MAX], row_to_col[ASSIGN_MAX];
+	int dx, dy, k, l;
+	double distance;
+
+	detector_diffs.frames++;
+	if (tpc != ref_count)
+		detector_diffs.count_diffs++;
+	for (k=0; k<tpc; k++) {
+		for (l=0; l<ref_count; l++) {
+			dx = tp[tpoint][k].x - ref[l].x;
+			dy = tp[tpoint][k].y - ref[l].y;
+			cost[k][l] = dx * dx + dy * dy;
+		}
+	}
+	assign_min_cost(tpc, ref_count, cost, TRACK_GATE_SQ, row_to_col);
+	for (k=0; k<tpc; k++) {
+		if (row_to_col[k] < 0)
+			continue;
+		distance = sqrt(cost[k][row_to_col[k]]);
+		detector_diffs.matched++;
+		detector_diffs.total_distance += distance;
+		detector_diffs.max_distance =
+			MAX(detector_diffs.max_distance, distance);
+	}
+}
+
+// Palms that were left out, each one counted once when it is first taken
+// for a palm
+unsigned int palms_rejected;
+
+void track_palm(struct touchpoint *t, struct touchpoint *prev) {
+	// A touch is taken for what it tracks to, palm or finger, until it has
+	// been shaped like the other for PALM_FRAMES frames in a row
+	int shaped_palm = t->palm;
+
+	t->palm = prev->palm;
+	t->shape_frames = shaped_palm != prev->palm ? prev->shape_frames + 1 : 0;
+	if (t->shape_frames >= PALM_FRAMES) {
+		t->palm = shaped_palm;
+		t->shape_frames = 0;
+		if (t->palm)
+			palms_rejected++;
+	}
+}
+
+int detect_touches(void) {
+	struct touchpoint ref[MAX_TOUCH];
+	int tpc, ref_count = 0;
+
+	if (compare_detector >= 0) {
+		ref_count = detectors[compare_detector].find_touches();
+		memcpy(ref, tp[tpoint], sizeof(ref));
+	}
+	tpc = detectors[detector_type].find_touches();
+	if (compare_detector >= 0)
+		compare_touches(ref, ref_count, tpc);
+	return tpc;
+}
+
+#if MAX_DELTA_FILTER
+int same_direction(struct touchpoint *t, struct touchpoint *prev) {
+	// The angle between the two directions is within MAX_DELTA_ANGLE if it
+	// is less than 90 degrees and tan(angle)^2 = cross^2 / dot^2 is small
+	// enough.
+	long long cross = (long long)t->dir_x * prev->dir_y -
+		(long long)t->dir_y * prev->dir_x;
+	long long dot = (long long)t->dir_x * prev->dir_x +
+		(long long)t->dir_y * prev->dir_y;
+
+	if (dot <= 0)
+		return 0;
+	return (cross * cross) << 16 < max_delta_tan_sq * dot * dot;
+}
+#endif // MAX_DELTA_FILTER
+
+void process_new_tpoint(struct touchpoint *t, int *tracking_id) {
+	// Handles setting up a brand new touch point
+	t->shape_frames = 0;
+	if (t->palm && t->highest_val > touch_delay_thresh) {
+		// Palms are only tracked so they stay left out, they don't need an
+		// ID
+		t->tracking_id = -1;
+		palms_rejected++;
+	} else if (t->highest_val > touch_delay_thresh) {
+		t->tracking_id = *tracking_id;
+		*tracking_id += 1;
+		telemetry_count(&telemetry.new_tracking_ids);
+		if (t->highest_val <= touch_initial_thresh)
+			t->touch_delay = touch_delay_count;
+	} else {
+		t->highest_val = 0;
+	}
+}
+
+void publish_tap(int tpc, int sent) {
+	// Copies the frame, the touch areas found in it and the touches that
+	// were sent into the tap. Bit k of sent is set if touch k was sent.
+	struct tap_frame *frame = tap_begin();
+	int k;
+
+	if (!frame)
+		return;
+	frame->frame = frame_count;
+	frame->read_ns = frame_read_ns;
+	memcpy(frame->matrix, matrix, sizeof(matrix));
+	frame->blob_count = tpc;
+	frame->touch_count = 0;
+	for (k=0; k<tpc; k++) {
+		frame->blobs[k].i = tp[tpoint][k].i;
+		frame->blobs[k].j = tp[tpoint][k].j;
+		frame->blobs[k].weight = tp[tpoint][k].pw;
+		frame->blobs[k].highest_val = tp[tpoint][k].highest_val;
+		if (!(sent & (1 << k)))
+			continue;
+		frame->touches[frame->touch_count].tracking_id =
+			tp[tpoint][k].tracking_id;
+		frame->touches[frame->touch_count].x = tp[tpoint][k].x;
+		frame->touches[frame->touch_count].y = tp[tpoint][k].y;
+		frame->touches[frame->touch_count].touch_major =
+			tp[tpoint][k].touch_major;
+		frame->touch_count++;
+	}
+	tap_end(frame);
+}
+
+int calc_point(void)
+{
+	int i, j, k;
+	int tpc = 0, sent = 0;
+	static int tracking_id = 0;
+#if DEBOUNCE_FILTER
+	int new_debounce_touch = 0;
+	static int initialx, initialy;
+#endif
+
+	if (tp[tpoint][0].x < -20) {
+		// We had a total liftoff
+		previoustpc = 0;
+#if DEBOUNCE_FILTER
+		new_debounce_touch = 1;
+#endif
+	} else {
+		// Re-assign array indexes
+		prev2tpoint = prevtpoint;
+		prevtpoint = tpoint;
+		tpoint++;
+		if (tpoint > 2)
+			tpoint = 0;
+	}
+
+#if RAW_DATA_DEBUG
+	for(i=0; i < X_AXIS_POINTS; i++) {
+		for(j=0; j < Y_AXIS_POINTS; j++) {
+			if (matrix[i][j] < RAW_DATA_THRESHOLD)
+				printf("   ");
+			else
+				printf("%2.2X ", matrix[i][j]);
+		}
+		printf(" |\n"); // end of row
+	}
+	printf("end of raw data\n"); // helps separate one frame from the next
+#endif
+
+	// Generate a list of touches
+	tpc = detect_touches();
+#if BASELINE_FILTER
+	if (baseline_recalibrate) {
+		baseline_recalibrate = 0;
+		init_baseline();
+	}
+	if (!tpc || baseline_frames < 1 << BASELINE_SHIFT)
+		update_baseline();
+	else
+		track_baseline();
+#endif
+
+	if (use_b_protocol) {
+		// Set all previously used slots to -1 so we know if we need to lift
+		// any of them off after matching
+		for (i=0; i<MAX_TOUCH; i++)
+			if(slot_in_use[i])
+				slot_in_use[i] = -1;
+	}
 
 	// Match up tracking IDs
 	{
-		int smallest_distance[MAX_TOUCH], cur_distance;
+		int smallest_distance[MAX_TOUCH];
 		int deltax, deltay;
 		int smallest_distance_loc[MAX_TOUCH];
-		// Find closest points for each touch
+		int cost[MAX_TOUCH][ASSIGN_MAX];
+		// Find the distances to the previous points, previous points that
+		// weren't reported can't be matched
 		for (i=0; i<tpc; i++) {
-			smallest_distance[i] = 1000000;
-			smallest_distance_loc[i] = -1;
 			for (j=0; j<previoustpc; j++) {
 				if (tp[prevtpoint][j].highest_val) {
 					deltax = tp[tpoint][i].unfiltered_x -
 						tp[prevtpoint][j].unfiltered_x;
 					deltay = tp[tpoint][i].unfiltered_y -
 						tp[prevtpoint][j].unfiltered_y;
-					cur_distance = (deltax * deltax) + (deltay * deltay);
-					if(cur_distance < smallest_distance[i]) {
-						smallest_distance[i] = cur_distance;
-						smallest_distance_loc[i] = j;
-					}
-				}
+					cost[i][j] = (deltax * deltax) + (deltay * deltay);
+				} else
+					cost[i][j] = TRACK_GATE_SQ + 1;
 			}
 		}
 
-		// Remove mapping for touches which aren't closest
-		for (i=0; i<tpc; i++) {
-			for (j=i + 1; j<tpc; j++) {
-				if (smallest_distance_loc[i] > -1 &&
-				   smallest_distance_loc[i] == smallest_distance_loc[j]) {
-					if (smallest_distance[i] < smallest_distance[j])
-						smallest_distance_loc[j] = -1;
-					else
-						smallest_distance_loc[i] = -1;
-				}
-			}
-		}
+		// Find the best match for all of the touches together
+		assign_min_cost(tpc, previoustpc, cost, TRACK_GATE_SQ,
+			smallest_distance_loc);
+		for (i=0; i<tpc; i++)
+			if (smallest_distance_loc[i] > -1)
+				smallest_distance[i] = cost[i][smallest_distance_loc[i]];
 
-		// Assign ids to closest touches
+		// Assign ids to matched touches
 		for (i=0; i<tpc; i++) {
 			if (smallest_distance_loc[i] > -1) {
 #if MAX_DELTA_FILTER
 				// Filter for impossibly large changes in touches
-				if (smallest_distance[i] > MAX_DELTA_SQ) {
+				if (smallest_distance[i] > max_delta_sq) {
 					int need_lift = 1;
 					// Check to see if the previous point was moving quickly
 					if (tp[prevtpoint][smallest_distance_loc[i]].distance >
-						MIN_PREV_DELTA_SQ) {
+						min_prev_delta_sq) {
 						// Check the direction of the previous point and see
 						// if we're continuing in roughly the same direction.
-						tp[tpoint][i].direction = atan2(
-						tp[tpoint][i].x -
-						tp[prevtpoint][smallest_distance_loc[i]].x,
-						tp[tpoint][i].y -
-						tp[prevtpoint][smallest_distance_loc[i]].y);
-						if (fabsf(tp[tpoint][i].direction -
-							tp[prevtpoint][smallest_distance_loc[i]].direction)
-							< MAX_DELTA_ANGLE) {
+						tp[tpoint][i].dir_x = tp[tpoint][i].x -
+							tp[prevtpoint][smallest_distance_loc[i]].x;
+						tp[tpoint][i].dir_y = tp[tpoint][i].y -
+							tp[prevtpoint][smallest_distance_loc[i]].y;
+						if (same_direction(&tp[tpoint][i],
+							&tp[prevtpoint][smallest_distance_loc[i]])) {
 #if MAX_DELTA_DEBUG
 							printf("direction is close enough, no liftoff\n");
 #endif
@@ -794,6 +2388,7 @@ int calc_point(void)
 #endif
 					if (need_lift) {
 						//  This is an impossibly large change in touches
+						telemetry_count(&telemetry.max_delta_liftoffs);
 #if TRACK_ID_DEBUG
 						printf("Over Delta %d - %d,%d - %d,%d -> %d,%d\n",
 							tp[prevtpoint][smallest_distance_loc[i]].
@@ -803,21 +2398,22 @@ int calc_point(void)
 							tp[prevtpoint][smallest_distance_loc[i]].x,
 							tp[prevtpoint][smallest_distance_loc[i]].y);
 #endif
-#if USE_B_PROTOCOL
+						if (use_b_protocol &&
+							tp[prevtpoint][smallest_distance_loc[i]].slot >= 0) {
 #if EVENT_DEBUG || MAX_DELTA_DEBUG
-						printf("sending max delta liftoff for slot: %i\n",
-							tp[prevtpoint][smallest_distance_loc[i]].slot);
+							printf("sending max delta liftoff for slot: %i\n",
+								tp[prevtpoint][smallest_distance_loc[i]].slot);
 #endif // EVENT_DEBUG || MAX_DELTA_DEBUG
-						liftoff_slot(
-							tp[prevtpoint][smallest_distance_loc[i]].slot);
-#endif // USE_B_PROTOCOL
+							liftoff_slot(
+								tp[prevtpoint][smallest_distance_loc[i]].slot);
+						}
 						process_new_tpoint(&tp[tpoint][i], &tracking_id);
 					}
 				} else
 #endif // MAX_DELTA_FILTER
 				{
 #if TRACK_ID_DEBUG
-					printf("Continue Map %d - %d,%d - %lf,%lf -> %lf,%lf\n",
+					printf("Continue Map %d - %d,%d - %d,%d -> %d,%d\n",
 						tp[prevtpoint][smallest_distance_loc[i]].tracking_id,
 						smallest_distance_loc[i], i, tp[tpoint][i].i,
 						tp[tpoint][i].j,
@@ -829,31 +2425,38 @@ int calc_point(void)
 					tp[tpoint][i].prev_loc = smallest_distance_loc[i];
 					tp[tpoint][i].touch_delay =
 						tp[prevtpoint][smallest_distance_loc[i]].touch_delay;
+					track_palm(&tp[tpoint][i],
+						&tp[prevtpoint][smallest_distance_loc[i]]);
+					if (tp[prevtpoint][smallest_distance_loc[i]].palm &&
+						!tp[tpoint][i].palm)
+						process_new_tpoint(&tp[tpoint][i], &tracking_id);
 #if MAX_DELTA_FILTER
-					// Track distance and angle
+					// Track distance and direction
 					tp[tpoint][i].distance = smallest_distance[i];
-					tp[tpoint][i].direction = atan2(
-						tp[tpoint][i].x -
-						tp[prevtpoint][smallest_distance_loc[i]].x,
-						tp[tpoint][i].y -
-						tp[prevtpoint][smallest_distance_loc[i]].y);
+					tp[tpoint][i].dir_x = tp[tpoint][i].x -
+						tp[prevtpoint][smallest_distance_loc[i]].x;
+					tp[tpoint][i].dir_y = tp[tpoint][i].y -
+						tp[prevtpoint][smallest_distance_loc[i]].y;
 #endif // MAX_DELTA_FILTER
-#if AVG_FILTER
+#if PREDICT_FILTER
+					predict_filter(&tp[tpoint][i]);
+#elif AVG_FILTER
 					avg_filter(&tp[tpoint][i]);
-#endif // AVG_FILTER
+#endif // PREDICT_FILTER
 #if HOVER_DEBOUNCE_FILTER
 					hover_debounce(i);
 #endif // HOVER_DEBOUNCE_FILTER
 				}
-#if USE_B_PROTOCOL
-				tp[tpoint][i].slot =
+				// Fingers that turned into palms give up their slot so it
+				// gets lifted off
+				tp[tpoint][i].slot = tp[tpoint][i].palm ? -1 :
 					tp[prevtpoint][smallest_distance_loc[i]].slot;
-				slot_in_use[tp[prevtpoint][smallest_distance_loc[i]].slot] = 1;
-#endif
+				if (use_b_protocol && tp[tpoint][i].slot >= 0)
+					slot_in_use[tp[tpoint][i].slot] = 1;
 			} else {
 				process_new_tpoint(&tp[tpoint][i], &tracking_id);
 #if TRACK_ID_DEBUG
-				printf("New Mapping - %lf,%lf - tracking ID: %i\n",
+				printf("New Mapping - %d,%d - tracking ID: %i\n",
 					tp[tpoint][i].i, tp[tpoint][i].j,
 					tp[tpoint][i].tracking_id);
 #endif
@@ -861,43 +2464,44 @@ int calc_point(void)
 		}
 	}
 
-#if USE_B_PROTOCOL
-	// Assign unused slots to touches that don't have a slot yet
-	for (i=0; i<tpc; i++) {
-		if (tp[tpoint][i].slot < 0 && tp[tpoint][i].highest_val &&
-			!tp[tpoint][i].touch_delay) {
-			for (j=0; j<MAX_TOUCH; j++) {
-				if (slot_in_use[j] <= 0) {
-					if (slot_in_use[j] == -1) {
+	if (use_b_protocol) {
+		// Assign unused slots to touches that don't have a slot yet
+		for (i=0; i<tpc; i++) {
+			if (tp[tpoint][i].slot < 0 && tp[tpoint][i].highest_val &&
+				!tp[tpoint][i].touch_delay && !tp[tpoint][i].palm) {
+				for (j=0; j<MAX_TOUCH; j++) {
+					if (slot_in_use[j] <= 0) {
+						if (slot_in_use[j] == -1) {
 #if EVENT_DEBUG
-						printf("lifting unused slot %i & reassigning it\n", j);
+							printf("lifting unused slot %i & reassigning it\n",
+								j);
 #endif
-						liftoff_slot(j);
-					}
-					tp[tpoint][i].slot = j;
-					slot_in_use[j] = 1;
+							liftoff_slot(j);
+						}
+						tp[tpoint][i].slot = j;
+						slot_in_use[j] = 1;
 #if TRACK_ID_DEBUG
-					printf("new slot [%i] trackID: %i slot: %i | %lf , %lf\n",
-						i, tp[tpoint][i].tracking_id, tp[tpoint][i].slot,
-						tp[tpoint][i].i, tp[tpoint][i].j);
+						printf("new slot [%i] trackID: %i slot: %i | %d , %d\n",
+							i, tp[tpoint][i].tracking_id, tp[tpoint][i].slot,
+							tp[tpoint][i].i, tp[tpoint][i].j);
 #endif
-					j = MAX_TOUCH;
+						j = MAX_TOUCH;
+					}
 				}
 			}
 		}
-	}
 
-	// Lift off any previously used slots that haven't been reassigned
-	for (i=0; i<MAX_TOUCH; i++) {
-		if (slot_in_use[i] == -1) {
+		// Lift off any previously used slots that haven't been reassigned
+		for (i=0; i<MAX_TOUCH; i++) {
+			if (slot_in_use[i] == -1) {
 #if EVENT_DEBUG
-			printf("lifting off slot %i - no longer in use\n", i);
+				printf("lifting off slot %i - no longer in use\n", i);
 #endif
-			liftoff_slot(i);
-			slot_in_use[i] = 0;
+				liftoff_slot(i);
+				slot_in_use[i] = 0;
+			}
 		}
 	}
-#endif // USE_B_PROTOCOL
 
 #if DEBOUNCE_FILTER
 	// The debounce filter only works on a single touch.
@@ -916,8 +2520,8 @@ int calc_point(void)
 		} else if (initialx > -20) {
 			// See if the current touch is still inside the debounce
 			// radius
-			if (abs(initialx - tp[tpoint][0].x) <= DEBOUNCE_RADIUS
-				&& abs(initialy - tp[tpoint][0].y) <= DEBOUNCE_RADIUS) {
+			if (abs(initialx - tp[tpoint][0].x) <= debounce_radius
+				&& abs(initialy - tp[tpoint][0].y) <= debounce_radius) {
 				// Set the point to the original point - debounce!
 				tp[tpoint][0].x = initialx;
 				tp[tpoint][0].y = initialy;
@@ -936,98 +2540,244 @@ int calc_point(void)
 
 	// Report touches
 	for (k = 0; k < tpc; k++) {
+		// Palms are tracked but never sent
+		if (tp[tpoint][k].palm)
+			continue;
 		if (tp[tpoint][k].highest_val && !tp[tpoint][k].touch_delay) {
 #if EVENT_DEBUG
 			printf("send event for tracking ID: %i\n",
 				tp[tpoint][k].tracking_id);
 #endif
-#if USE_B_PROTOCOL
-			send_uevent(uinput_fd, EV_ABS, ABS_MT_SLOT, tp[tpoint][k].slot);
-#endif
-			send_uevent(uinput_fd, EV_ABS, ABS_MT_TRACKING_ID,
-				tp[tpoint][k].tracking_id);
-			send_uevent(uinput_fd, EV_ABS, ABS_MT_TOUCH_MAJOR,
-				tp[tpoint][k].touch_major);
-			send_uevent(uinput_fd, EV_ABS, ABS_MT_POSITION_X, tp[tpoint][k].x);
-			send_uevent(uinput_fd, EV_ABS, ABS_MT_POSITION_Y, tp[tpoint][k].y);
-#if !USE_B_PROTOCOL
-			send_uevent(uinput_fd, EV_SYN, SYN_MT_REPORT, 0);
-#endif
+			sent |= 1 << k;
+			if (use_b_protocol) {
+				report_slot(&tp[tpoint][k]);
+			} else {
+				send_uevent(uinput_fd, EV_ABS, ABS_MT_TRACKING_ID,
+					tp[tpoint][k].tracking_id);
+				send_uevent(uinput_fd, EV_ABS, ABS_MT_TOUCH_MAJOR,
+					tp[tpoint][k].touch_major);
+				send_uevent(uinput_fd, EV_ABS, ABS_MT_POSITION_X,
+					tp[tpoint][k].x);
+				send_uevent(uinput_fd, EV_ABS, ABS_MT_POSITION_Y,
+					tp[tpoint][k].y);
+				send_uevent(uinput_fd, EV_SYN, SYN_MT_REPORT, 0);
+			}
 		} else if (tp[tpoint][k].touch_delay) {
 			// This touch didn't meet the threshold so we don't report it yet
 			tp[tpoint][k].touch_delay--;
 		}
 	}
-	if (tpc > 0) {
+	// Protocol B skips frames where nothing changed
+	if (use_b_protocol ? event_count > 0 : tpc > 0) {
 		send_uevent(uinput_fd, EV_SYN, SYN_REPORT, 0);
 	}
+	if (tap_subscribers)
+		publish_tap(tpc, sent);
 	previoustpc = tpc; // Store the touch count for the next run
 	if (tracking_id >  2147483000)
 		tracking_id = 0; // Reset tracking ID counter if it gets too big
+	// Protocol B frames that changed nothing don't flush, and the next
+	// flush must not count their time as latency
+	frame_read_ns = 0;
 	return tpc; // Return the touch count
 }
 
 
-int cline_valid(unsigned int extras)
+int line_length(const unsigned char *line)
 {
-	if (cline[0] == 0xff && cline[1] == 0x43 && cidx == 44-extras) {
-		return 1;
-	}
-	if (cline[0] == 0xff && cline[1] == 0x47 && cidx > 4 &&
-		cidx == (cline[2]+4-extras)) {
-		return 1;
-	}
+	// Length of a line from its first 3 bytes, 0 if it is not a line that
+	// we use. A 0xFF can only be the last byte of a line, anywhere else it
+	// starts a new line.
+	if (line[1] == 0x43)
+		return ROW_LINE_LEN;
+	if (line[1] == 0x47 && line[2] > 0)
+		return line[2] + 4;
 	return 0;
 }
 
-void put_byte(unsigned char byte)
-{
-	if(cidx==0 && byte != 0xFF)
-		return;
+void start_matrix(void) {
+	// A new frame starts in matrix, its rows are labeled as they are added
+	start_labeling();
+	next_label_row = 0;
+}
 
-	// Sometimes a send is aborted by the touch screen. all we get is an out of
-	// place 0xFF
-	if(byte == 0xFF && !cline_valid(1))
-		cidx = 0;
+void add_matrix_row(int row) {
+	// Row of matrix was filled in. The replay and the processing thread
+	// both come through here, so they label the rows the same way.
+#if BASELINE_FILTER
+	baseline_row(row);
+#endif
+	if (detectors[detector_type].add_row)
+		detectors[detector_type].add_row(row);
+}
 
-	cline[cidx++] = byte;
+void copy_ring_rows(unsigned char *frame, unsigned int number,
+	unsigned int rows) {
+	// Adds the rows of a frame from the ring that aren't in matrix yet
+	unsigned char (*slot)[Y_AXIS_POINTS] = (void *)frame;
+	int i;
+
+	if (number != matrix_frame || !matrix_rows) {
+		start_matrix();
+		matrix_frame = number;
+		matrix_rows = 0;
+	}
+	for (i=0; i<X_AXIS_POINTS; i++) {
+		if (!(rows & ~matrix_rows & 1U << i))
+			continue;
+		memcpy(matrix[i], slot[i], Y_AXIS_POINTS);
+		add_matrix_row(i);
+	}
+	matrix_rows |= rows;
 }
 
-int consume_line(void)
+int consume_line(const unsigned char *line)
 {
-	int i,j,ret=0;
+	int row,ret=0;
 
-	if(cline[1] == 0x47) {
-		// Calculate the data points. all transfers complete
-		ret = calc_point();
+	if(line[1] == 0x47) {
+		if (frame_rows != ALL_ROWS) {
+			// Some rows are missing or left over from an earlier frame
+			parse_stats.incomplete_frames++;
+#if DROP_INCOMPLETE_FRAMES
+			frame_rows = 0;
+			if (use_frame_ring)
+				frame_ring_restart();
+			else
+				next_label_row = -1;
+			return 0;
+#endif
+		}
+		frame_rows = 0;
+		if (use_frame_ring) {
+			// The processing thread takes the frame from here, the
+			// return value counts frames and rows instead of touches
+			frame_ring_publish(read_ns);
+			line_matrix = (void *)frame_ring_write_slot();
+			ret = 1;
+		} else {
+			// Calculate the data points. all transfers complete
+			frame_read_ns = read_ns;
+			ret = calc_point();
+			frame_count++;
+			telemetry_frame(ret);
+		}
 	}
 
-	if(cline[1] == 0x43) {
+	if(line[1] == 0x43) {
 		// This is a start event. clear the matrix
-		if(cline[2] & 0x80) {
-			for(i=0; i < X_AXIS_POINTS; i++)
-				for(j=0; j < Y_AXIS_POINTS; j++)
-					matrix[i][j] = 0;
+		if(line[2] & 0x80) {
+			if (use_frame_ring)
+				frame_ring_restart();
+			memset(line_matrix, 0, sizeof(matrix));
+			frame_rows = 0;
+			if (!use_frame_ring)
+				start_matrix();
 		}
 
-		// Write the line into the matrix
-		for(i=0; i < Y_AXIS_POINTS; i++)
-			matrix[cline[2] & 0x1F][i] = cline[i+3];
+		// Write the line into the matrix and label it. With the reader
+		// thread the processing thread labels the row once it is handed
+		// over.
+		row = line[2] & 0x1F;
+		if(row < X_AXIS_POINTS) {
+			if (use_frame_ring && frame_rows & 1 << row)
+				frame_ring_restart();
+			memcpy(line_matrix[row], &line[3], Y_AXIS_POINTS);
+			frame_rows |= 1 << row;
+			if (use_frame_ring) {
+				frame_ring_publish_row(row);
+				ret = 1;
+			} else {
+				add_matrix_row(row);
+			}
+		}
 	}
 
-	cidx = 0;
-
 	return ret;
 }
 
+unsigned char *finish_line(unsigned char *bytes, unsigned char *end,
+	int *ret)
+{
+	// Adds the data from bytes to the line that was cut off at the end of
+	// the last read, returns where the data after the line starts
+	unsigned char *ff;
+	int len, size;
+
+	while (cidx < 3) {
+		if (bytes == end)
+			return bytes;
+		if (*bytes == 0xFF) {
+			parse_stats.aborted_lines++;
+			cidx = 0;
+			return bytes;
+		}
+		cline[cidx++] = *bytes++;
+	}
+	len = line_length(cline);
+	if (!len) {
+		cidx = 0;
+		return bytes;
+	}
+
+	size = MIN(len - (int)cidx, end - bytes);
+	ff = memchr(bytes, 0xFF, MIN(size, len - (int)cidx - 1));
+	if (ff) {
+		parse_stats.aborted_lines++;
+		cidx = 0;
+		return ff;
+	}
+	memcpy(&cline[cidx], bytes, size);
+	cidx += size;
+	if ((int)cidx == len) {
+		*ret += consume_line(cline);
+		cidx = 0;
+	}
+	return bytes + size;
+}
+
 int snarf2(unsigned char* bytes, int size)
 {
-	int i,ret=0;
+	// Splits the data read from the uart into lines. memchr finds the 0xFF
+	// that starts each line and checks that no other 0xFF cuts it off.
+	// Lines that are all there are used straight from bytes, only a line
+	// that is cut off at the end is copied to cline.
+	unsigned char *end = bytes + size, *ff;
+	int len, ret=0;
+
+	while (bytes < end) {
+		if (cidx) {
+			bytes = finish_line(bytes, end, &ret);
+			continue;
+		}
+
+		ff = memchr(bytes, 0xFF, end - bytes);
+		if (ff != bytes)
+			parse_stats.resyncs++;
+		if (!ff)
+			break;
+		bytes = ff;
 
-	for(i=0; i < size; i++) {
-		put_byte(bytes[i]);
-		if(cline_valid(0))
-			ret += consume_line();
+		len = end - bytes >= 3 ? line_length(bytes) : -1;
+		if (!len) {
+			bytes++;
+			continue;
+		}
+		if (len < 0 || len > end - bytes) {
+			// The rest of the line comes with the next read
+			cline[0] = 0xFF;
+			cidx = 1;
+			bytes++;
+			continue;
+		}
+		ff = memchr(bytes + 1, 0xFF, len - 2);
+		if (ff) {
+			parse_stats.aborted_lines++;
+			bytes = ff;
+			continue;
+		}
+		ret += consume_line(bytes);
+		bytes += len;
 	}
 
 	return ret;
@@ -1065,10 +2815,8 @@ void open_uinput(void)
 	if (ioctl(uinput_fd,UI_SET_EVBIT,EV_ABS) < 0)
 		fprintf(stderr, "error evbit rel\n");
 
-#if USE_B_PROTOCOL
-	if (ioctl(uinput_fd,UI_SET_ABSBIT,ABS_MT_SLOT) < 0)
+	if (use_b_protocol && ioctl(uinput_fd,UI_SET_ABSBIT,ABS_MT_SLOT) < 0)
 		fprintf(stderr, "error slot rel\n");
-#endif
 
 	if (ioctl(uinput_fd,UI_SET_ABSBIT,ABS_MT_TRACKING_ID) < 0)
 		fprintf(stderr, "error trkid rel\n");
@@ -1091,38 +2839,35 @@ void open_uinput(void)
 
 void clear_arrays(void)
 {
-	// Clears array (for after a total liftoff occurs)
+	// Clears array (for after a total liftoff occurs). Only what is looked
+	// at before set_tpoint sets up a new touch needs to be cleared.
 	int i, j;
 	for (i=0; i<3; i++) {
 		for(j=0; j<MAX_TOUCH; j++) {
-			tp[i][j].pw = -1000;
-			tp[i][j].i = -1000;
-			tp[i][j].j = -1000;
-#if USE_B_PROTOCOL
-			tp[i][j].slot = -1;
-#endif
-			tp[i][j].tracking_id = -1;
-			tp[i][j].prev_loc = -1;
 #if MAX_DELTA_FILTER
-			tp[i][j].direction = 0;
+			// New touches keep the distance of the touch that was in
+			// their spot before
 			tp[i][j].distance = 0;
 #endif
-			tp[i][j].touch_major = 0;
 			tp[i][j].x = -1000;
-			tp[i][j].y = -1000;
-			tp[i][j].unfiltered_x = -1000;
-			tp[i][j].unfiltered_y = -1000;
-			tp[i][j].highest_val = -1000;
-			tp[i][j].touch_delay = -1000;
-#if HOVER_DEBOUNCE_FILTER
-			tp[i][j].hover_x = -1000;
-			tp[i][j].hover_y = -1000;
-			tp[i][j].hover_delay = HOVER_DEBOUNCE_DELAY;
-#endif
 		}
 	}
 }
 
+void set_protocol(int b_protocol) {
+	// Changes the multi-touch protocol. The uinput device has to be created
+	// again as only protocol B devices have slots.
+	if (b_protocol == use_b_protocol)
+		return;
+	liftoff();
+	clear_arrays();
+	ioctl(uinput_fd, UI_DEV_DESTROY);
+	close(uinput_fd);
+	use_b_protocol = b_protocol;
+	reset_slots();
+	open_uinput();
+}
+
 void open_uart(int *uart_fd) {
 	struct hsuart_mode uart_mode;
 	*uart_fd = open("/dev/ctp_uart", O_RDONLY|O_NONBLOCK);
@@ -1182,6 +2927,15 @@ void set_ts_mode(int mode){
 		touch_delay_thresh = TOUCH_DELAY_THRESHOLD_S;
 		touch_delay_count = TOUCH_DELAY_S;
 	}
+	// The stylus threshold may be below a large_area_fringe that was set
+	// for fingers, see set_params()
+	if (large_area_fringe > touch_continue_thresh)
+		large_area_fringe = touch_continue_thresh;
+#if BASELINE_FILTER
+	touch_delay_count = 0;
+#endif
+	// Rows labeled so far in this frame used the old threshold
+	next_label_row = -1;
 }
 
 int read_settings_file(void) {
@@ -1242,32 +2996,488 @@ void write_settings_file(int setting) {
 	fclose(fp);
 }
 
-void process_socket_buffer(char *buffer[], int buffer_len, int *uart_fd,
-	int accept_fd) {
+void watch_fd(int fd) {
+	struct epoll_event event;
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.fd = fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+		printf("Unable to watch fd %i\n", fd);
+}
+
+void set_timer(int timer_fd, int usec) {
+	// Arms a timer to go off once after usec, 0 disarms it
+	struct itimerspec spec;
+
+	memset(&spec, 0, sizeof(spec));
+	spec.it_value.tv_sec = usec / 1000000;
+	spec.it_value.tv_nsec = (usec % 1000000) * 1000;
+	timerfd_settime(timer_fd, 0, &spec, NULL);
+}
+
+void set_thread_priority(int cpu, int priority) {
+	// Pins the calling thread to cpu and gives it RT priority so that there
+	// is no delay in obtaining input and it is NEVER bumped from the CPU
+	// until it gives it up itself.
+	struct sched_param sparam = { .sched_priority = priority };
+	cpu_set_t cpus;
+	int ret;
+
+	if (cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+		if (sched_setaffinity(0 /* that's us */, sizeof(cpus), &cpus))
+			perror("Cannot pin thread to cpu, ignoring: ");
+	}
+	ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sparam);
+	if (ret)
+		printf("Cannot set RT priority, ignoring: %s\n", strerror(ret));
+}
+
+void *uart_reader(void *arg) {
+	// Reads the uart and puts complete frames in the frame ring until
+	// reader_stop_fd is written
+	int uart_fd = (int)(long)arg, nbytes;
+	unsigned char recv_buf[RECV_BUF_SIZE];
+	unsigned long long count = 1;
+	struct pollfd fds[2];
+
+	set_thread_priority(READER_CPU, READER_PRIORITY);
+	fds[0].fd = uart_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = reader_stop_fd;
+	fds[1].events = POLLIN;
+	while (1) {
+		if (poll(fds, 2, -1) <= 0)
+			continue;
+		if (fds[1].revents)
+			break;
+		nbytes = read(uart_fd, recv_buf, RECV_BUF_SIZE);
+		if (nbytes <= 0)
+			continue;
+		read_ns = telemetry_now_ns();
+		trace_write(recv_buf, nbytes);
+#if DEBUG
+		printf("Received %d bytes\n", nbytes);
+#endif
+		if (snarf2(recv_buf, nbytes) &&
+			write(frame_event_fd, &count, sizeof(count)) < 0)
+			printf("Unable to signal new frames\n");
+	}
+	return NULL;
+}
+
+void start_reader(int uart_fd) {
+	// A line or frame that was cut off when the reader last stopped is
+	// dropped
+	cidx = 0;
+	frame_rows = 0;
+	frame_ring_restart();
+	matrix_rows = 0;
+	line_matrix = (void *)frame_ring_write_slot();
+	use_frame_ring = 1;
+	if (pthread_create(&reader_thread, NULL, uart_reader,
+		(void *)(long)uart_fd)) {
+		printf("Unable to start the uart reader thread\n");
+		return;
+	}
+	reader_running = 1;
+}
+
+void stop_reader(void) {
+	unsigned long long count = 1;
+
+	if (!reader_running)
+		return;
+	if (write(reader_stop_fd, &count, sizeof(count)) < 0)
+		printf("Unable to stop the uart reader thread\n");
+	pthread_join(reader_thread, NULL);
+	if (read(reader_stop_fd, &count, sizeof(count)) < 0)
+		count = 0;
+	reader_running = 0;
+#if FRAME_RING_DEBUG
+	printf("frame ring: %u published, %u consumed, %u dropped, "
+		"max %u waiting\n", frame_ring_stats.published,
+		frame_ring_stats.consumed, frame_ring_stats.dropped,
+		frame_ring_stats.max_used);
+#endif
+}
+
+void *fit_worker(void *arg) {
+	// Helps the processing thread with the fit jobs of each frame until
+	// the driver exits
+	int worker = (int)(long)arg;
+	unsigned int generation;
+
+	if (fit_workers_pinned)
+		set_thread_priority(FIT_CPU, FIT_PRIORITY);
+	// Jobs that were handed out before this worker was counted aren't
+	// its to take
+	pthread_mutex_lock(&fit_lock);
+	generation = fit_generation;
+	fit_workers_running++;
+	while (1) {
+		while (fit_generation == generation)
+			pthread_cond_wait(&fit_start, &fit_lock);
+		generation = fit_generation;
+		pthread_mutex_unlock(&fit_lock);
+		run_fit_jobs(worker);
+		pthread_mutex_lock(&fit_lock);
+		if (--fit_workers_busy == 0)
+			pthread_cond_signal(&fit_done);
+	}
+	return NULL;
+}
+
+void start_fit_workers(int pinned) {
+	// Starts the fit workers if they are wanted and the peak detector is in
+	// use, the other detectors don't fit. They are only pinned and given RT
+	// priority when driving the touchscreen, not when replaying or
+	// benchmarking. Once started they stay until the driver exits. pinned
+	// is -1 to start them only if they were wanted before.
+	pthread_t thread;
+
+	if (pinned >= 0) {
+		fit_workers_wanted = 1;
+		fit_workers_pinned = pinned;
+	}
+	if (!fit_workers_wanted || fit_workers_started ||
+		detector_type != find_detector("peak"))
+		return;
+	for (; fit_workers_started<FIT_WORKERS; fit_workers_started++) {
+		if (pthread_create(&thread, NULL, fit_worker,
+			(void *)(long)(fit_workers_started + 1))) {
+			printf("Unable to start the peak fit threads\n");
+			fit_workers_started = FIT_WORKERS;
+			break;
+		}
+		pthread_detach(thread);
+	}
+}
+
+void start_power(int enable) {
+	// Powering the digitizer on or off takes a few steps with waits in
+	// between that are timed with power_timer_fd
+	power_enable = enable;
+	set_timer(power_timer_fd, touchscreen_power_start(enable));
+}
+
+void power_step(int *uart_fd) {
+	int wait = touchscreen_power_step();
+
+	if (wait) {
+		set_timer(power_timer_fd, wait);
+	} else if (power_enable && *uart_fd < 0) {
+		open_uart(uart_fd);
+		start_reader(*uart_fd);
+#if DEBUG_SOCKET
+		printf("uart opened at %i\n", *uart_fd);
+#endif
+	}
+}
+
+// The tuning parameters that K commands can read and change, with the
+// range of values each one takes
+struct tuning_param {
+	const char *name;
+	int *value;
+	int min;
+	int max;
+};
+
+struct tuning_param tuning_params[] = {
+	{ "touch_initial_thresh", &touch_initial_thresh, 1, 255 },
+	{ "touch_continue_thresh", &touch_continue_thresh, 1, 255 },
+	{ "touch_delay_thresh", &touch_delay_thresh, 1, 255 },
+	{ "touch_delay_count", &touch_delay_count, 0, 1000 },
+	{ "max_delta", &max_delta, 0, X_RESOLUTION },
+	{ "min_prev_delta", &min_prev_delta, 0, X_RESOLUTION },
+	{ "max_delta_angle_mrad", &max_delta_angle_mrad, 0, 1500 },
+	{ "debounce_radius", &debounce_radius, 0, X_RESOLUTION },
+	{ "hover_debounce_radius", &hover_debounce_radius, 0, X_RESOLUTION },
+	{ "hover_debounce_delay", &hover_debounce_delay, 0, 1000 },
+	{ "large_area_fringe", &large_area_fringe, 1, LARGE_AREA_UNPRESS - 1 },
+	{ "pixels_per_point", &pixels_per_point, 1, X_RESOLUTION },
+	{ "liftoff_timeout", &liftoff_timeout, 1000, 1000000 },
+	{ "detector", &detector_type, 0, DETECTOR_COUNT - 1 },
+};
+
+#define TUNING_PARAM_COUNT \
+	((int)(sizeof(tuning_params) / sizeof(tuning_params[0])))
+
+void apply_params(void) {
+	// Works out the values that depend on the tuning parameters
+	double tan_angle = tan(max_delta_angle_mrad / 1000.0);
+
+	max_delta_sq = max_delta * max_delta;
+	min_prev_delta_sq = min_prev_delta * min_prev_delta;
+	max_delta_tan_sq = tan_angle * tan_angle * 65536;
+	// Rows labeled so far in this frame may have used the old thresholds
+	next_label_row = -1;
+	// The detector may have been switched to the peak detector
+	start_fit_workers(-1);
+}
+
+int find_tuning_param(const char *name) {
+	int i;
+
+	for (i=0; i<TUNING_PARAM_COUNT; i++)
+		if (!strcmp(tuning_params[i].name, name))
+			return i;
+	return -1;
+}
+
+int get_params(char *args, char *text, int text_size) {
+	// Puts " name=value" in text for the named parameters, or for all of
+	// them if there are no names. Returns 0 if all of the names are known.
+	char *name, *save;
+	int i, len = 0, all = 1;
+
+	for (name=strtok_r(args, " ", &save); name;
+		name=strtok_r(NULL, " ", &save)) {
+		all = 0;
+		i = find_tuning_param(name);
+		if (i < 0) {
+			snprintf(text, text_size, " unknown key %s", name);
+			return -1;
+		}
+		if (len < text_size)
+			len += snprintf(&text[len], text_size - len, " %s=%i",
+				name, *tuning_params[i].value);
+	}
+	for (i=0; all && i<TUNING_PARAM_COUNT && len<text_size; i++)
+		len += snprintf(&text[len], text_size - len, " %s=%i",
+			tuning_params[i].name, *tuning_params[i].value);
+	return 0;
+}
+
+int set_params(char *args, char *text, int text_size) {
+	// Sets the parameters from "name=value" pairs. Every pair is checked
+	// before any parameter changes, so either all of them are set or none
+	// of them are. Returns 0 if they were set, otherwise the reason is put
+	// in text.
+	int values[TUNING_PARAM_COUNT];
+	char *pair, *save, *value, *end;
+	int i;
+	long v;
+
+	for (i=0; i<TUNING_PARAM_COUNT; i++)
+		values[i] = *tuning_params[i].value;
+	for (pair=strtok_r(args, " ", &save); pair;
+		pair=strtok_r(NULL, " ", &save)) {
+		value = strchr(pair, '=');
+		if (!value) {
+			snprintf(text, text_size, " expected key=value");
+			return -1;
+		}
+		*value++ = 0;
+		i = find_tuning_param(pair);
+		if (i < 0) {
+			snprintf(text, text_size, " unknown key %s", pair);
+			return -1;
+		}
+		v = strtol(value, &end, 10);
+		if (end == value || *end || v < tuning_params[i].min ||
+			v > tuning_params[i].max) {
+			snprintf(text, text_size, " %s must be %i to %i", pair,
+				tuning_params[i].min, tuning_params[i].max);
+			return -1;
+		}
+		values[i] = v;
+	}
+	// Seeds between touch_continue_thresh and large_area_fringe would be
+	// left out of the fringe lists and silently lost
+	if (values[find_tuning_param("touch_continue_thresh")] <
+		values[find_tuning_param("large_area_fringe")]) {
+		snprintf(text, text_size, " touch_continue_thresh must be at least"
+			" large_area_fringe");
+		return -1;
+	}
+	for (i=0; i<TUNING_PARAM_COUNT; i++)
+		*tuning_params[i].value = values[i];
+	apply_params();
+	return 0;
+}
+
+void get_stats(char *text, int text_size) {
+	// Puts " name=value" in text for each counter. The histograms are
+	// lists of bucket counts, see telemetry.h.
+	int len, i;
+
+	len = snprintf(text, text_size, " frames=%u fps=%u"
+		" latency_p50_us=%u latency_p99_us=%u latency_hist=",
+		telemetry.frames, telemetry_fps(),
+		telemetry_latency_percentile(50), telemetry_latency_percentile(99));
+	for (i=0; i<LATENCY_BUCKETS && len<text_size; i++)
+		len += snprintf(&text[len], text_size - len, "%s%u", i ? "," : "",
+			telemetry.latency[i]);
+	if (len < text_size)
+		len += snprintf(&text[len], text_size - len, " touches_hist=");
+	for (i=0; i<TOUCH_BUCKETS && len<text_size; i++)
+		len += snprintf(&text[len], text_size - len, "%s%u", i ? "," : "",
+			telemetry.touches[i]);
+	if (len < text_size)
+		len += snprintf(&text[len], text_size - len, " aborted_lines=%u"
+			" resyncs=%u incomplete_frames=%u dropped_frames=%u"
+			" ring_max_used=%u max_delta_liftoffs=%u timeout_liftoffs=%u"
+			" new_tracking_ids=%u", parse_stats.aborted_lines,
+			parse_stats.resyncs, parse_stats.incomplete_frames,
+			frame_ring_stats.dropped, frame_ring_stats.max_used,
+			telemetry.max_delta_liftoffs, telemetry.timeout_liftoffs,
+			telemetry.new_tracking_ids);
+}
+
+void send_key_reply(int fd, char *reply, int len, int pass_fd) {
+	// Sends a reply line, pass_fd goes along with it if it isn't -1
+	char control[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = reply;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (pass_fd >= 0) {
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+	}
+	if (sendmsg(fd, &msg, MSG_NOSIGNAL) != len)
+		printf("Unable to send key reply to socket\n");
+}
+
+void process_key_command(char *line, struct socket_client *client) {
+	// Handles a line of the key/value protocol and sends back one line:
+	//   K1 get [key ...]          -> K1 ok key=value ...
+	//   K1 set key=value [...]    -> K1 ok
+	//   K1 stats                  -> K1 ok counter=value ...
+	//   K1 tap                    -> K1 ok size=N with the tap fd attached
+	//   K1 calibrate              -> K1 ok, the baseline is learned over
+	// or K1 error <reason>. The tap is written to until the client hangs
+	// up, see tap.h for its layout. Only version K1 exists so far, other versions
+	// get an error back so that a newer client can tell.
+	char reply[KEY_REPLY_SIZE], text[KEY_REPLY_SIZE];
+	char *version, *command, *args, *save;
+	int len, failed, pass_fd = -1;
+
+	version = strtok_r(line, " ", &save);
+	command = strtok_r(NULL, " ", &save);
+	args = strtok_r(NULL, "", &save);
+	if (!args)
+		args = "";
+	text[0] = 0;
+	if (strcmp(version, KEY_PROTOCOL_VERSION)) {
+		snprintf(text, sizeof(text), " unsupported version");
+		failed = 1;
+	} else if (command && !strcmp(command, "get")) {
+		failed = get_params(args, text, sizeof(text));
+	} else if (command && !strcmp(command, "set")) {
+		failed = set_params(args, text, sizeof(text));
+	} else if (command && !strcmp(command, "stats")) {
+		get_stats(text, sizeof(text));
+		failed = 0;
+	} else if (command && !strcmp(command, "tap")) {
+		pass_fd = tap_fd();
+		failed = pass_fd < 0;
+		if (failed) {
+			snprintf(text, sizeof(text), " no shared memory");
+		} else {
+			snprintf(text, sizeof(text), " size=%u", (unsigned int)TAP_SIZE);
+			if (!client->tapped)
+				tap_subscribers++;
+			client->tapped = 1;
+		}
+#if BASELINE_FILTER
+	} else if (command && !strcmp(command, "calibrate")) {
+		// The processing thread starts over with its next frame
+		baseline_recalibrate = 1;
+		failed = 0;
+#endif
+	} else {
+		snprintf(text, sizeof(text), " unknown command");
+		failed = 1;
+	}
+	len = snprintf(reply, sizeof(reply) - 1, "%s %s%s", KEY_PROTOCOL_VERSION,
+		failed ? "error" : "ok", text);
+	if (len > (int)sizeof(reply) - 2)
+		len = sizeof(reply) - 2;
+	reply[len++] = '\n';
+	send_key_reply(client->fd, reply, len, pass_fd);
+#if DEBUG_SOCKET
+	printf("Key command reply: %.*s", len, reply);
+#endif
+}
+
+struct socket_client *find_socket_client(int fd) {
+	// Finds the client using fd, -1 finds an unused entry
+	int i;
+
+	for (i=0; i<MAX_SOCKET_CLIENTS; i++)
+		if (socket_clients[i].fd == fd)
+			return &socket_clients[i];
+	return NULL;
+}
+
+void process_socket_buffer(char *buffer, int buffer_len, int *uart_fd,
+	struct socket_client *client) {
 	// Processes data that is received from the socket
 	// O = open uart
 	// C = close uart
 	// F = finger mode
 	// S = stylus mode
 	// M = return current mode
+	// A = multi-touch protocol A
+	// B = multi-touch protocol B
+	// K = key/value command up to a newline, see process_key_command()
 	int i, return_val, buf;
 
 	for (i=0; i<buffer_len; i++) {
-		buf = (int)*buffer;
-		if (buf == 67 /* 'C' */ && *uart_fd >= 0) {
-			return_val = close(*uart_fd);
-			*uart_fd = -1;
-#if DEBUG_SOCKET
-			printf("uart closed: %i\n", return_val);
-#endif
-			touchscreen_power(0);
+		buf = buffer[i];
+		if (client->line_len >= 0) {
+			if (buf == '\n') {
+				if (client->line_len < KEY_LINE_SIZE) {
+					client->line[client->line_len] = 0;
+					process_key_command(client->line, client);
+				} else {
+					char error[] = KEY_PROTOCOL_VERSION
+						" error line too long\n";
+					send(client->fd, error, strlen(error), MSG_NOSIGNAL);
+				}
+				client->line_len = -1;
+			} else if (buf != '\r') {
+				// A line that doesn't fit is marked with KEY_LINE_SIZE
+				if (client->line_len < KEY_LINE_SIZE - 1)
+					client->line[client->line_len++] = buf;
+				else
+					client->line_len = KEY_LINE_SIZE;
+			}
+			continue;
+		}
+		if (buf == 75 /* 'K' */) {
+			client->line[0] = buf;
+			client->line_len = 1;
 		}
-		if (buf == 79 /* 'O' */ && *uart_fd < 0) {
-			touchscreen_power(1);
-			open_uart(uart_fd);
+		if (buf == 67 /* 'C' */ && power_enable) {
+			if (*uart_fd >= 0) {
+				stop_reader();
+				return_val = close(*uart_fd);
+				*uart_fd = -1;
 #if DEBUG_SOCKET
-			printf("uart opened at %i\n", *uart_fd);
+				printf("uart closed: %i\n", return_val);
 #endif
+			}
+			start_power(0);
+		}
+		if (buf == 79 /* 'O' */ && !power_enable) {
+			// The uart is opened once the digitizer is powered on
+			start_power(1);
 		}
 		if (buf == 70 /* 'F' */) {
 			set_ts_mode(0);
@@ -1281,6 +3491,12 @@ void process_socket_buffer(char *buffer[], int buffer_len, int *uart_fd,
 			write_settings_file(1);
 #if DEBUG_SOCKET
 			printf("stylus mode set\n");
+#endif
+		}
+		if (buf == 65 /* 'A' */ || buf == 66 /* 'B' */) {
+			set_protocol(buf == 66);
+#if DEBUG_SOCKET
+			printf("protocol %c set\n", buf);
 #endif
 		}
 		if (buf == 77 /* 'M' */) {
@@ -1288,7 +3504,7 @@ void process_socket_buffer(char *buffer[], int buffer_len, int *uart_fd,
 			int send_ret;
 
 			current_mode[0] = read_settings_file();
-			send_ret = send(accept_fd, (char*)current_mode,
+			send_ret = send(client->fd, (char*)current_mode,
 				sizeof(*current_mode), 0);
 #if DEBUG_SOCKET
 			if (send_ret <= 0)
@@ -1298,33 +3514,616 @@ void process_socket_buffer(char *buffer[], int buffer_len, int *uart_fd,
 					(int)current_mode[0]);
 #endif
 		}
-		buffer++;
 	}
 }
 
+void timeout_liftoff(int *need_liftoff) {
+	// No data has arrived from the uart for LIFTOFF_TIMEOUT
+#if DEBUG
+	printf("timeout! no data coming from uart\n");
+#endif
+	if (*need_liftoff) {
+#if EVENT_DEBUG
+		printf("timeout called liftoff\n");
+#endif
+		telemetry_count(&telemetry.timeout_liftoffs);
+		liftoff();
+		clear_arrays();
+		*need_liftoff = 0;
+	}
+}
+
+void check_touches(int touches, int *need_liftoff) {
+	if (!touches) {
+		// Sometimes there's data but no valid touches due to threshold
+		if (*need_liftoff) {
+#if EVENT_DEBUG
+			printf("snarf2 called liftoff\n");
+#endif
+			liftoff();
+			clear_arrays();
+			*need_liftoff = 0;
+		}
+	} else
+		*need_liftoff = 1;
+}
+
+void process_uart_data(unsigned char *recv_buf, int nbytes,
+	int *need_liftoff) {
+	// Processes touch data that was read from the uart
+	unsigned int frames = frame_count;
+	int touches;
+#if DEBUG
+	printf("Received %d bytes\n", nbytes);
+	int i;
+	for(i=0; i < nbytes; i++)
+		printf("%2.2X ",recv_buf[i]);
+	printf("\n");
+#endif
+	read_ns = telemetry_now_ns();
+	touches = snarf2(recv_buf,nbytes);
+	// Like the processing thread, only complete frames can lift off. Data
+	// that doesn't finish a frame or a frame that was dropped doesn't.
+	if (frame_count != frames)
+		check_touches(touches, need_liftoff);
+}
+
+void process_frames(int *need_liftoff) {
+	// Processes the frames that the uart reader thread handed over since
+	// the last time, like one read of uart data
+	unsigned char *frame;
+	unsigned int number, rows;
+	int touches = 0, frames = 0, tpc;
+#if FRAME_RING_DEBUG
+	unsigned int used = frame_ring_used(), dropped = frame_ring_stats.dropped;
+#endif
+
+	while ((frame = frame_ring_read_slot(&frame_read_ns, &number)) != NULL) {
+		// Only the rows that weren't labeled while they were arriving
+		// are left
+		copy_ring_rows(frame, number, ALL_ROWS);
+		frame_ring_release();
+		matrix_rows = 0;
+		tpc = calc_point();
+		touches += tpc;
+		frames++;
+		frame_count++;
+		telemetry_frame(tpc);
+	}
+	if (frames)
+		check_touches(touches, need_liftoff);
+
+	// Label the rows of the frame that is still arriving
+	frame = frame_ring_partial_slot(&number, &rows);
+	if (rows) {
+		copy_ring_rows(frame, number, rows);
+		if (!frame_ring_partial_valid(number))
+			matrix_rows = 0;
+	}
+#if FRAME_RING_DEBUG
+	if (used > 1 || dropped != frame_ring_stats.dropped)
+		printf("frame ring: %u waiting, %u dropped\n", used,
+			frame_ring_stats.dropped);
+#endif
+}
+
+void reset_driver_state(int stylus_mode) {
+	// Puts the driver in the same state as a fresh start for replaying
+	set_ts_mode(stylus_mode);
+	cidx = 0;
+	frame_rows = 0;
+	next_label_row = -1;
+	frame_count = 0;
+	memset(&parse_stats, 0, sizeof(parse_stats));
+	memset(fit_stats, 0, sizeof(fit_stats));
+	reset_slots();
+	liftoff();
+	clear_arrays();
+#if BASELINE_FILTER
+	init_baseline();
+#endif
+}
+
+void print_fit_stats(void) {
+	struct fit_counts total;
+	int k;
+
+	// Adds up the counts of all of the threads
+	memset(&total, 0, sizeof(total));
+	for (k=0; k<=FIT_WORKERS; k++) {
+		total.cold_fits += fit_stats[k].cold_fits;
+		total.cold_iterations += fit_stats[k].cold_iterations;
+		total.warm_fits += fit_stats[k].warm_fits;
+		total.warm_iterations += fit_stats[k].warm_iterations;
+		total.warm_retries += fit_stats[k].warm_retries;
+		total.joint_fits += fit_stats[k].joint_fits;
+		total.joint_iterations += fit_stats[k].joint_iterations;
+		total.joint_failures += fit_stats[k].joint_failures;
+	}
+	if (!total.cold_fits && !total.warm_fits && !total.joint_fits)
+		return;
+	printf("%u peak fits from scratch, %.2f iterations each\n",
+		total.cold_fits, total.cold_fits ?
+		(double)total.cold_iterations / total.cold_fits : 0);
+	printf("%u peak fits warm started, %.2f iterations each, %u retried\n",
+		total.warm_fits + total.warm_retries,
+		total.warm_fits + total.warm_retries ?
+		(double)total.warm_iterations /
+		(total.warm_fits + total.warm_retries) : 0,
+		total.warm_retries);
+	if (total.joint_fits)
+		printf("%u joint peak fits, %.2f iterations each, %u failed\n",
+			total.joint_fits, (double)total.joint_iterations /
+			total.joint_fits, total.joint_failures);
+}
+
+int replay_trace(char *trace_path, char *out_path, int stylus_mode) {
+	// Feeds a recorded trace through the driver. Input events are written
+	// to out_path instead of uinput.
+	unsigned char recv_buf[RECV_BUF_SIZE];
+	unsigned int delta_us;
+	int nbytes, need_liftoff = 0, records = 0;
+
+	if (trace_open_read(trace_path))
+		return -1;
+	uinput_fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (uinput_fd < 0) {
+		printf("Unable to open %s for writing\n", out_path);
+		return -1;
+	}
+
+	reset_driver_state(stylus_mode);
+	while ((nbytes = trace_read(recv_buf, RECV_BUF_SIZE, &delta_us)) > 0) {
+		// The live driver would have timed out waiting for this data
+		if (delta_us >= (unsigned int)liftoff_timeout)
+			timeout_liftoff(&need_liftoff);
+		process_uart_data(recv_buf, nbytes, &need_liftoff);
+		records++;
+	}
+	// The trace always ends with the digitizer going quiet
+	timeout_liftoff(&need_liftoff);
+
+	if (nbytes < 0)
+		printf("Trace file is damaged after record %i\n", records);
+	printf("Replayed %i records, %u frames\n", records, frame_count);
+	printf("%u aborted lines, %u resyncs, %u incomplete frames\n",
+		parse_stats.aborted_lines, parse_stats.resyncs,
+		parse_stats.incomplete_frames);
+	print_fit_stats();
+#if PALM_REJECT
+	printf("%u palms left out\n", palms_rejected);
+#endif
+	trace_close();
+	close(uinput_fd);
+	return nbytes < 0 ? -1 : 0;
+}
+
+long long elapsed_ns(struct timespec *start, struct timespec *end) {
+	return (end->tv_sec - start->tv_sec) * 1000000000LL +
+		(end->tv_nsec - start->tv_nsec);
+}
+
+int compare_ns(const void *v1, const void *v2) {
+	long long a = *(const long long *)v1, b = *(const long long *)v2;
+	return (a > b) - (a < b);
+}
+
+int benchmark_trace(char *trace_path, int runs, int stylus_mode) {
+	// Measures how long the driver takes to process each frame of a trace.
+	// Time spent reading the trace and writing events is not counted.
+	unsigned char recv_buf[RECV_BUF_SIZE];
+	unsigned int delta_us, prev_frame_count;
+	int nbytes = 0, need_liftoff, run;
+	int frames = 0, max_frames = 0;
+	long long *frame_ns = NULL, pending_ns, total_ns = 0, ns;
+	struct timespec start, end;
+
+	if (trace_open_read(trace_path))
+		return -1;
+	uinput_fd = open("/dev/null", O_WRONLY);
+
+	for (run=0; run<runs; run++) {
+		trace_rewind();
+		reset_driver_state(stylus_mode);
+		need_liftoff = 0;
+		pending_ns = 0;
+		while ((nbytes = trace_read(recv_buf, RECV_BUF_SIZE, &delta_us)) > 0) {
+			prev_frame_count = frame_count;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			if (delta_us >= (unsigned int)liftoff_timeout)
+				timeout_liftoff(&need_liftoff);
+			process_uart_data(recv_buf, nbytes, &need_liftoff);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+
+			ns = elapsed_ns(&start, &end);
+			total_ns += ns;
+			pending_ns += ns;
+			if (frame_count == prev_frame_count)
+				continue;
+			// A read can complete more than one frame, split the time
+			// spent evenly between them.
+			pending_ns /= frame_count - prev_frame_count;
+			for (; prev_frame_count < frame_count; prev_frame_count++) {
+				if (frames == max_frames) {
+					max_frames = max_frames ? max_frames * 2 : 4096;
+					frame_ns = realloc(frame_ns,
+						max_frames * sizeof(*frame_ns));
+					if (!frame_ns) {
+						printf("Out of memory\n");
+						return -1;
+					}
+				}
+				frame_ns[frames++] = pending_ns;
+			}
+			pending_ns = 0;
+		}
+		if (nbytes < 0)
+			break;
+	}
+	trace_close();
+	close(uinput_fd);
+
+	if (nbytes < 0 || !frames) {
+		printf("No frames found in %s\n", trace_path);
+		free(frame_ns);
+		return -1;
+	}
+
+	qsort(frame_ns, frames, sizeof(*frame_ns), compare_ns);
+	printf("frames: %i (%i runs)\n", frames, runs);
+	printf("frames/sec: %.0f\n", frames * 1000000000.0 / total_ns);
+	printf("per frame latency: p50 %lld ns, p99 %lld ns, max %lld ns\n",
+		frame_ns[frames / 2], frame_ns[(frames * 99) / 100],
+		frame_ns[frames - 1]);
+	free(frame_ns);
+	return 0;
+}
+
+int benchmark_detectors(char *trace_path, int runs, int stylus_mode) {
+	// Benchmarks each detector against the trace, then replays it once
+	// more with each detector matched up against the first one. There is
+	// no ground truth in a trace so the flood fill is the reference.
+	unsigned char recv_buf[RECV_BUF_SIZE];
+	unsigned int delta_us;
+	int nbytes, need_liftoff = 0, d, selected = detector_type;
+
+	for (d=0; d<DETECTOR_COUNT; d++) {
+		printf("detector %s:\n", detectors[d].name);
+		detector_type = d;
+		start_fit_workers(-1);
+		if (benchmark_trace(trace_path, runs, stylus_mode))
+			return -1;
+	}
+
+	for (d=1; d<DETECTOR_COUNT; d++) {
+		if (trace_open_read(trace_path))
+			return -1;
+		uinput_fd = open("/dev/null", O_WRONLY);
+		detector_type = d;
+		compare_detector = 0;
+		memset(&detector_diffs, 0, sizeof(detector_diffs));
+		reset_driver_state(stylus_mode);
+		while ((nbytes = trace_read(recv_buf, RECV_BUF_SIZE, &delta_us)) > 0) {
+			if (delta_us >= (unsigned int)liftoff_timeout)
+				timeout_liftoff(&need_liftoff);
+			process_uart_data(recv_buf, nbytes, &need_liftoff);
+		}
+		trace_close();
+		close(uinput_fd);
+
+		printf("%s against %s: %u of %u frames found a different number "
+			"of touches\n", detectors[d].name, detectors[0].name,
+			detector_diffs.count_diffs, detector_diffs.frames);
+		printf("%u touches matched, distance mean %.1f px, max %.1f px\n",
+			detector_diffs.matched, detector_diffs.matched ?
+			detector_diffs.total_distance / detector_diffs.matched : 0,
+			detector_diffs.max_distance);
+	}
+	compare_detector = -1;
+	detector_type = selected;
+	return 0;
+}
+
+int benchmark_assign(int runs) {
+	// Measures how long matching up touches takes for each number of
+	// touches. The previous touches are spread out at random and the new
+	// touches are the same touches moved a little, in a random order.
+	static int costs[BENCH_ASSIGN_SOLVES][MAX_TOUCH][ASSIGN_MAX];
+	int prev_x[MAX_TOUCH], prev_y[MAX_TOUCH], order[MAX_TOUCH];
+	int row_to_col[MAX_TOUCH];
+	int n, solve, run, i, j, k, tmp, x, y;
+	long long ns, max_ns;
+	struct timespec start, end, solve_end;
+
+	srand(1);
+	for (n=1; n<=MAX_TOUCH; n++) {
+		for (solve=0; solve<BENCH_ASSIGN_SOLVES; solve++) {
+			for (j=0; j<n; j++) {
+				prev_x[j] = rand() % X_RESOLUTION;
+				prev_y[j] = rand() % Y_RESOLUTION;
+				order[j] = j;
+			}
+			for (i=n - 1; i>0; i--) {
+				k = rand() % (i + 1);
+				tmp = order[i];
+				order[i] = order[k];
+				order[k] = tmp;
+			}
+			for (i=0; i<n; i++) {
+				x = prev_x[order[i]] + rand() % 121 - 60;
+				y = prev_y[order[i]] + rand() % 121 - 60;
+				for (j=0; j<n; j++)
+					costs[solve][i][j] = (x - prev_x[j]) * (x - prev_x[j]) +
+						(y - prev_y[j]) * (y - prev_y[j]);
+			}
+		}
+
+		max_ns = 0;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (run=0; run<runs; run++) {
+			for (solve=0; solve<BENCH_ASSIGN_SOLVES; solve++) {
+				clock_gettime(CLOCK_MONOTONIC, &end);
+				assign_min_cost(n, n, costs[solve], TRACK_GATE_SQ,
+					row_to_col);
+				clock_gettime(CLOCK_MONOTONIC, &solve_end);
+				ns = elapsed_ns(&end, &solve_end);
+				if (ns > max_ns)
+					max_ns = ns;
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		// The average includes the time spent reading the clock
+		printf("%2i touches: avg %lld ns, max %lld ns\n", n,
+			elapsed_ns(&start, &end) / (runs * BENCH_ASSIGN_SOLVES),
+			max_ns);
+	}
+	return 0;
+}
+
+int benchmark_fit(int runs) {
+	// Measures how long the fixed size peak fit and the levmar fit take on
+	// made up touches, and checks that they find the same centers
+	static float windows[BENCH_FIT_WINDOWS][FIT_MAX_SIZE * FIT_MAX_SIZE];
+	static float fast[BENCH_FIT_WINDOWS][3];
+	double window[FIT_MAX_SIZE * FIT_MAX_SIZE], p[3], offset[2];
+	double ci, cj, value, sd, distance, max_distance = 0;
+	int n, run, k, peak, iterations = 0;
+	struct timespec start, end;
+
+	srand(1);
+	for (n=0; n<BENCH_FIT_WINDOWS; n++) {
+		value = 20 + rand() % 200;
+		ci = (rand() % 2001 - 1000) / 1000.0;
+		cj = (rand() % 2001 - 1000) / 1000.0;
+		sd = FIT_SD * (0.8 + (rand() % 401) / 1000.0);
+		for (k=0; k<FIT_MAX_SIZE * FIT_MAX_SIZE; k++) {
+			windows[n][k] = (int)(value * exp(-(pow(k / FIT_MAX_SIZE -
+				FIT_MAX_SIZE / 2 - ci, 2) + pow(k % FIT_MAX_SIZE -
+				FIT_MAX_SIZE / 2 - cj, 2)) / (2 * sd * sd)) +
+				rand() % 5 - 2);
+			if (windows[n][k] < 0)
+				windows[n][k] = 0;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (run=0; run<runs; run++) {
+		for (n=0; n<BENCH_FIT_WINDOWS; n++) {
+			peak = 0;
+			for (k=0; k<FIT_MAX_SIZE * FIT_MAX_SIZE; k++)
+				peak = MAX(peak, windows[n][k]);
+			fast[n][0] = peak;
+			fast[n][1] = 0;
+			fast[n][2] = 0;
+			iterations += fit_gaussian(FIT_MAX_SIZE / 2, fast[n],
+				windows[n]);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("fixed size fit: avg %lld ns, %.1f iterations\n",
+		elapsed_ns(&start, &end) / (runs * BENCH_FIT_WINDOWS),
+		(double)iterations / (runs * BENCH_FIT_WINDOWS));
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (n=0; n<BENCH_FIT_WINDOWS; n++) {
+		peak = 0;
+		for (k=0; k<FIT_MAX_SIZE * FIT_MAX_SIZE; k++) {
+			window[k] = windows[n][k];
+			peak = MAX(peak, windows[n][k]);
+		}
+		p[0] = peak;
+		p[1] = 0;
+		p[2] = 0;
+		runlm(&fit_ctx[0], FIT_MAX_SIZE / 2, p, window, offset);
+		distance = sqrt(pow(offset[0] - fast[n][1], 2) +
+			pow(offset[1] - fast[n][2], 2));
+		max_distance = MAX(max_distance, distance);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("levmar fit: avg %lld ns\n",
+		elapsed_ns(&start, &end) / BENCH_FIT_WINDOWS);
+	printf("largest difference in the centers: %.4f points\n",
+		max_distance);
+
+	// What handing the jobs of a frame to the fit workers costs before
+	// any of them is fitted, to weigh against FIT_PARALLEL_MIN fits
+	detector_type = find_detector("peak");
+	start_fit_workers(0);
+	while (fit_workers_running < fit_workers_started)
+		sched_yield();
+	if (!fit_workers_running)
+		return 0;
+	fit_job_count = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (n=0; n<runs * BENCH_FIT_WINDOWS; n++)
+		share_fit_jobs();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("fit worker handoff: avg %lld ns\n",
+		elapsed_ns(&start, &end) / (runs * BENCH_FIT_WINDOWS));
+	return 0;
+}
+
+int calibrate_edges(char *table_path, char **trace_paths, int count,
+	int stylus_mode) {
+	// Replays traces with the peak detector and makes an edge correction
+	// table from the touches that were fitted
+	int k;
+
+	if (edge_calib_init(X_AXIS_POINTS, Y_AXIS_POINTS))
+		return -1;
+	detector_type = find_detector("peak");
+	start_fit_workers(-1);
+	edge_calibrating = 1;
+	for (k=0; k<count; k++)
+		if (replay_trace(trace_paths[k], "/dev/null", stylus_mode))
+			return -1;
+	return edge_calib_write(table_path);
+}
+
+void capture_signal(int sig) {
+	// Write out whatever is left of the capture before we go away
+	trace_flush();
+	_exit(sig);
+}
+
+void print_usage(void) {
+	printf("Usage:\n");
+	printf("ts_srv                       normal operation\n");
+	printf("ts_srv -c <file>             record uart data to a trace file\n");
+	printf("ts_srv -r <file> -o <out>    replay a trace, write events to out\n");
+	printf("ts_srv -b <file> [-n runs]   benchmark against a trace\n");
+	printf("ts_srv -a [-n runs]          benchmark matching up touches\n");
+	printf("ts_srv -f [-n runs]          benchmark and check the peak fit\n");
+	printf("ts_srv -b <file> -C          benchmark and compare the detectors\n");
+	printf("ts_srv -E <table> <file>...  make an edge table from traces\n");
+	printf("Add -d <detector> to use the flood or peak detector\n");
+	printf("Add -S to replay or benchmark with the stylus thresholds\n");
+	printf("Add -B to send events with multi-touch protocol B\n");
+	printf("Add -e <table> to use an edge table with the peak detector\n");
+}
+
 int main(int argc, char** argv)
 {
-	int uart_fd, nbytes, need_liftoff = 0, sel_ret, socket_fd;
-	unsigned char recv_buf[RECV_BUF_SIZE];
-	fd_set fdset;
-	struct timeval seltmout;
-	/* linux maximum priority is 99, nonportable */
-	struct sched_param sparam = { .sched_priority = 99 };
+	int uart_fd, need_liftoff = 0, socket_fd, accept_fd;
+	int nevents, i, fd, liftoff_armed = 0, wait_us;
+	struct socket_client *client;
+	char recv_str[SOCKET_BUFFER_SIZE];
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+	struct timespec last_data, now;
+	unsigned long long expirations;
+	char *capture_path = NULL, *replay_path = NULL, *bench_path = NULL,
+		*out_path = NULL, *edge_path = NULL, *calib_path = NULL;
+	int opt, runs = BENCH_DEFAULT_RUNS, stylus_mode = 0, bench_assign = 0;
+	int bench_compare = 0, bench_fit = 0;
+
+	init_weight_table();
+	apply_params();
+#if BASELINE_FILTER
+	init_baseline();
+#endif
+	for (i=0; i<MAX_SOCKET_CLIENTS; i++)
+		socket_clients[i].fd = -1;
+
+	while ((opt = getopt(argc, argv, "c:r:o:b:n:SaBd:Cfe:E:")) != -1) {
+		switch (opt) {
+			case 'c':
+				capture_path = optarg;
+				break;
+			case 'r':
+				replay_path = optarg;
+				break;
+			case 'o':
+				out_path = optarg;
+				break;
+			case 'b':
+				bench_path = optarg;
+				break;
+			case 'n':
+				runs = atoi(optarg);
+				break;
+			case 'S':
+				stylus_mode = 1;
+				break;
+			case 'a':
+				bench_assign = 1;
+				break;
+			case 'B':
+				use_b_protocol = 1;
+				break;
+			case 'd':
+				detector_type = find_detector(optarg);
+				if (detector_type < 0) {
+					print_usage();
+					return -1;
+				}
+				break;
+			case 'C':
+				bench_compare = 1;
+				break;
+			case 'f':
+				bench_fit = 1;
+				break;
+			case 'e':
+				edge_path = optarg;
+				break;
+			case 'E':
+				calib_path = optarg;
+				break;
+			default:
+				print_usage();
+				return -1;
+		}
+	}
+	if (edge_path && edge_load(edge_path, X_AXIS_POINTS, Y_AXIS_POINTS))
+		return -1;
+	if (replay_path || bench_path || calib_path)
+		start_fit_workers(0);
+	if (calib_path) {
+		if (optind >= argc) {
+			print_usage();
+			return -1;
+		}
+		return calibrate_edges(calib_path, &argv[optind], argc - optind,
+			stylus_mode);
+	}
+	if (replay_path) {
+		if (!out_path) {
+			print_usage();
+			return -1;
+		}
+		return replay_trace(replay_path, out_path, stylus_mode);
+	}
+	if (bench_path && bench_compare)
+		return benchmark_detectors(bench_path, runs > 0 ? runs : 1,
+			stylus_mode);
+	if (bench_path)
+		return benchmark_trace(bench_path, runs > 0 ? runs : 1,
+			stylus_mode);
+	if (bench_assign)
+		return benchmark_assign(runs > 0 ? runs : 1);
+	if (bench_fit)
+		return benchmark_fit(runs > 0 ? runs : 1);
 
-	/* We set ts server priority to RT so that there is no delay in
-	 * in obtaining input and we are NEVER bumped from CPU until we
-	 * give it up ourselves. */
-	if (sched_setscheduler(0 /* that's us */, SCHED_FIFO, &sparam))
-		perror("Cannot set RT priority, ignoring: ");
+	// This thread does the processing, the uart has its own thread
+	set_thread_priority(PROCESS_CPU, PROCESS_PRIORITY);
+	start_fit_workers(1);
 
 	init_digitizer_fd();
 	touchscreen_power(1);
 
 	open_uart(&uart_fd);
 
+	reset_slots();
 	open_uinput();
 
 	read_settings_file();
+	if (!edge_path)
+		edge_load(EDGE_TABLE_FILE, X_AXIS_POINTS, Y_AXIS_POINTS);
+
+	if (capture_path && !trace_open_write(capture_path)) {
+		signal(SIGINT, capture_signal);
+		signal(SIGTERM, capture_signal);
+	}
 
 	// Lift off in case of driver crash or in case the driver was shut off to
 	// save power by closing the uart.
@@ -1333,100 +4132,102 @@ int main(int argc, char** argv)
 
 	create_ts_socket(&socket_fd);
 
-	while(1) {
-		FD_ZERO(&fdset);
-		if (uart_fd >= 0)
-			FD_SET(uart_fd, &fdset);
-		if (socket_fd >= 0)
-			FD_SET(socket_fd, &fdset);
-		seltmout.tv_sec = 0;
-		/* 2x tmout */
-		seltmout.tv_usec = LIFTOFF_TIMEOUT;
-
-		sel_ret = select(MAX(uart_fd, socket_fd) + 1, &fdset, NULL, NULL,
-			&seltmout);
-		if (sel_ret == 0) {
-			/* Timeout means no more data and probably need to lift off */
-#if DEBUG
-			printf("timeout! no data coming from uart\n");
-#endif
-
-			if (need_liftoff) {
-#if EVENT_DEBUG
-				printf("timeout called liftoff\n");
-#endif
-				liftoff();
-				clear_arrays();
-				need_liftoff = 0;
-			}
-
-			FD_ZERO(&fdset);
-			if (uart_fd >= 0)
-				FD_SET(uart_fd, &fdset);
-			if (socket_fd >= 0)
-				FD_SET(socket_fd, &fdset);
-			/* Now enter indefinite sleep until input appears */
-			select(MAX(uart_fd, socket_fd) + 1, &fdset, NULL, NULL, NULL);
-			/* In case we were wrongly woken up check the event
-			 * count again */
-			continue;
-		}
+	// Everything is registered once and stays registered. The uart is read
+	// by the reader thread while it is open, which signals frame_event_fd.
+	epoll_fd = epoll_create(MAX_EPOLL_EVENTS);
+	liftoff_timer_fd = timerfd_create(CLOCK_MONOTONIC, 0);
+	power_timer_fd = timerfd_create(CLOCK_MONOTONIC, 0);
+	frame_event_fd = eventfd(0, 0);
+	reader_stop_fd = eventfd(0, 0);
+	watch_fd(liftoff_timer_fd);
+	watch_fd(power_timer_fd);
+	watch_fd(frame_event_fd);
+	if (socket_fd >= 0)
+		watch_fd(socket_fd);
+	frame_ring_init();
+	if (uart_fd >= 0)
+		start_reader(uart_fd);
 
-		if (uart_fd >= 0 && FD_ISSET(uart_fd, &fdset)) {
-			// This is touch data from the uart
-			nbytes = read(uart_fd, recv_buf, RECV_BUF_SIZE);
+	while(1) {
+		nevents = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+		for (i=0; i<nevents; i++) {
+			fd = events[i].data.fd;
+			if (fd == frame_event_fd) {
+				// These are frames from the uart reader thread
+				if (read(fd, &expirations, sizeof(expirations)) <= 0)
+					continue;
+				process_frames(&need_liftoff);
 
-			if(nbytes <= 0)
-				continue;
-#if DEBUG
-			printf("Received %d bytes\n", nbytes);
-			int i;
-			for(i=0; i < nbytes; i++)
-				printf("%2.2X ",recv_buf[i]);
-			printf("\n");
-#endif
-			if (!snarf2(recv_buf,nbytes)) {
-				// Sometimes there's data but no valid touches due to threshold
-				if (need_liftoff) {
-#if EVENT_DEBUG
-					printf("snarf2 called liftoff\n");
+				// The timer is only armed once per LIFTOFF_TIMEOUT and not
+				// for every frame, when it goes off it checks when the last
+				// data came in.
+				clock_gettime(CLOCK_MONOTONIC, &last_data);
+				if (need_liftoff && !liftoff_armed) {
+					set_timer(liftoff_timer_fd, liftoff_timeout);
+					liftoff_armed = 1;
+				}
+			} else if (fd == liftoff_timer_fd) {
+				if (read(fd, &expirations, sizeof(expirations)) <= 0)
+					continue;
+				liftoff_armed = 0;
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				wait_us = liftoff_timeout -
+					elapsed_ns(&last_data, &now) / 1000;
+				if (need_liftoff && wait_us > 0) {
+					set_timer(liftoff_timer_fd, wait_us);
+					liftoff_armed = 1;
+				} else {
+					/* Timeout means no more data and probably need to
+					 * lift off */
+					timeout_liftoff(&need_liftoff);
+				}
+			} else if (fd == power_timer_fd) {
+				if (read(fd, &expirations, sizeof(expirations)) > 0)
+					power_step(&uart_fd);
+			} else if (fd == socket_fd) {
+				// A new client, it stays connected until it hangs up
+				accept_fd = accept(socket_fd, NULL, NULL);
+				if (accept_fd < 0) {
+#if DEBUG_SOCKET
+					printf("Accept failed\n");
 #endif
-					liftoff();
-					clear_arrays();
-					need_liftoff = 0;
+					continue;
 				}
-			} else
-				need_liftoff = 1;
-		}
-
-		if (socket_fd >= 0 && FD_ISSET(socket_fd, &fdset)) {
-			// This is data from the socket
-			int accept_fd;
-			accept_fd = accept(socket_fd, NULL, NULL);
-			if (accept_fd >= 0) {
-				char recv_str[SOCKET_BUFFER_SIZE];
+				client = find_socket_client(-1);
+				if (!client) {
+					close(accept_fd);
+					continue;
+				}
+				client->fd = accept_fd;
+				client->line_len = -1;
+				client->tapped = 0;
+				watch_fd(accept_fd);
+			} else {
+				// This is data from a socket client
 				int recv_ret;
 
-				recv_ret = recv(accept_fd, recv_str, SOCKET_BUFFER_SIZE, 0);
+				client = find_socket_client(fd);
+				if (!client)
+					continue;
+				recv_ret = recv(fd, recv_str, SOCKET_BUFFER_SIZE, 0);
 				if (recv_ret > 0) {
 #if DEBUG_SOCKET
-					printf("Socket received %i byte(s): '%s'\n", recv_ret,
-						recv_str);
+					printf("Socket received %i byte(s): '%.*s'\n", recv_ret,
+						recv_ret, recv_str);
 #endif
-					process_socket_buffer((char **)&recv_str, recv_ret,
-						&uart_fd, accept_fd);
+					process_socket_buffer(recv_str, recv_ret, &uart_fd,
+						client);
+					continue;
 				}
 #if DEBUG_SOCKET
-				else {
-					if (recv_ret < 0)
-						printf("Receive error\n");
-					else
-						printf("No actual data to receive\n");
-				}
-				close(accept_fd);
-			} else {
-				printf("Accept failed\n");
+				if (recv_ret < 0)
+					printf("Receive error\n");
 #endif
+				epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+				close(fd);
+				client->fd = -1;
+				if (client->tapped)
+					tap_subscribers--;
 			}
 		}
 	}
@@ -29,14 +29,28 @@
  * F = Finger
  * S = Stylus
  * M = return current Mode
+ * A = multi-touch protocol A
+ * B = multi-touch protocol B
+ *
+ * Tuning parameters can be read and changed with
+ * get [key ...]               print the named parameters, or all of them
+ * set key=value [key=value]   change parameters, all of them or none
+ * stats                       print latency and health counters
+ * tap [frames]                print frames as the driver processes them
  */
 
 #include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 
+#include "tap.h"
+#include "key_protocol.h"
+
 #define TS_SOCKET_LOCATION "/dev/socket/tsdriver"
 #define TS_SOCKET_TIMEOUT 500000
 #define SOCKET_BUFFER_SIZE 1
@@ -75,6 +89,222 @@ int receive_ts_mode(int ts_fd) {
 	}
 }
 
+int receive_key_reply(int ts_fd, char *reply) {
+	// Receives one line from the touchscreen socket
+	struct timeval seltmout;
+	fd_set fdset;
+	int len = 0, recv_ret;
+
+	while (len == 0 || reply[len - 1] != '\n') {
+		seltmout.tv_sec = 0;
+		seltmout.tv_usec = TS_SOCKET_TIMEOUT;
+		FD_ZERO(&fdset);
+		FD_SET(ts_fd, &fdset);
+		if (select(ts_fd + 1, &fdset, NULL, NULL, &seltmout) <= 0) {
+			printf("Unable to retrieve settings - timeout\n");
+			return -40;
+		}
+		recv_ret = recv(ts_fd, &reply[len], KEY_REPLY_SIZE - 1 - len, 0);
+		if (recv_ret <= 0) {
+			printf("Error receiving settings\n");
+			return -50;
+		}
+		len += recv_ret;
+		if (len == KEY_REPLY_SIZE - 1)
+			break;
+	}
+	reply[len] = 0;
+	return 0;
+}
+
+int connect_ts_socket(void) {
+	// Connects to the touchscreen socket, returns the fd or an error
+	struct sockaddr_un unaddr;
+	int ts_fd, len;
+
+	ts_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (ts_fd < 0) {
+		printf("Unable to create socket\n");
+		return -10;
+	}
+	unaddr.sun_family = AF_UNIX;
+	strcpy(unaddr.sun_path, TS_SOCKET_LOCATION);
+	len = strlen(unaddr.sun_path) + sizeof(unaddr.sun_family);
+	if (connect(ts_fd, (struct sockaddr *)&unaddr, len) < 0) {
+		printf("Unable to connect socket\n");
+		close(ts_fd);
+		return -20;
+	}
+	return ts_fd;
+}
+
+int send_key_command(int argc, char **argv) {
+	// Sends "K1 get ...", "K1 set ...", "K1 stats" or "K1 calibrate" and
+	// prints the reply
+	char line[KEY_LINE_SIZE], reply[KEY_REPLY_SIZE], *value, *save;
+	int ts_fd, len, i, ret;
+
+	len = snprintf(line, sizeof(line), "%s", KEY_PROTOCOL_VERSION);
+	for (i=0; i<argc && len<(int)sizeof(line); i++)
+		len += snprintf(&line[len], sizeof(line) - len, " %s", argv[i]);
+	if (len >= (int)sizeof(line) - 1) {
+		printf("Too many settings at once\n");
+		return -70;
+	}
+	line[len++] = '\n';
+
+	ts_fd = connect_ts_socket();
+	if (ts_fd < 0)
+		return ts_fd;
+	if (send(ts_fd, line, len, 0) != len) {
+		printf("Unable to send data to socket\n");
+		close(ts_fd);
+		return -30;
+	}
+	ret = receive_key_reply(ts_fd, reply);
+	close(ts_fd);
+	if (ret)
+		return ret;
+
+	// The reply is "K1 ok [key=value ...]" or "K1 error <reason>"
+	reply[strcspn(reply, "\r\n")] = 0;
+	value = strtok_r(reply, " ", &save);
+	value = strtok_r(NULL, " ", &save);
+	if (!value || strcmp(value, "ok")) {
+		value = strtok_r(NULL, "", &save);
+		printf("Touchscreen settings error: %s\n",
+			value ? value : "unknown");
+		return -60;
+	}
+	if (!strcmp(argv[0], "set"))
+		printf("Touchscreen settings changed\n");
+	else if (!strcmp(argv[0], "calibrate"))
+		printf("Touchscreen baseline being learned again\n");
+	while ((value = strtok_r(NULL, " ", &save)) != NULL)
+		printf("%s\n", value);
+	return 0;
+}
+
+int receive_tap_fd(int ts_fd) {
+	// Receives the reply to K1 tap along with the shared memory fd
+	char reply[KEY_REPLY_SIZE], control[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	int recv_ret, fd = -1;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = reply;
+	iov.iov_len = sizeof(reply) - 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	recv_ret = recvmsg(ts_fd, &msg, 0);
+	if (recv_ret <= 0) {
+		printf("Error receiving tap\n");
+		return -50;
+	}
+	reply[recv_ret] = 0;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+		cmsg->cmsg_type == SCM_RIGHTS)
+		memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	if (fd < 0) {
+		printf("Touchscreen tap error: %s", reply);
+		return -60;
+	}
+	return fd;
+}
+
+void print_tap_frame(struct tap_frame *frame) {
+	// Prints the matrix the same way RAW_DATA_DEBUG does, then the touch
+	// areas and the touches that were sent
+	unsigned int i, j;
+
+	printf("frame %u\n", frame->frame);
+	for (i=0; i<TAP_ROWS; i++) {
+		for (j=0; j<TAP_COLS; j++) {
+			if (frame->matrix[i][j])
+				printf("%2.2X ", frame->matrix[i][j]);
+			else
+				printf("   ");
+		}
+		printf(" |\n");
+	}
+	for (i=0; i<frame->blob_count && i<TAP_MAX_TOUCH; i++)
+		printf("area %u: %.2f,%.2f weight %i highest %i\n", i,
+			frame->blobs[i].i / 256.0, frame->blobs[i].j / 256.0,
+			frame->blobs[i].weight, frame->blobs[i].highest_val);
+	for (i=0; i<frame->touch_count && i<TAP_MAX_TOUCH; i++)
+		printf("touch %i: %i,%i major %i\n", frame->touches[i].tracking_id,
+			frame->touches[i].x, frame->touches[i].y,
+			frame->touches[i].touch_major);
+}
+
+int read_tap(int frames) {
+	// Prints the next frames that the driver processes. The connection has
+	// to stay open for the driver to keep writing to the tap.
+	struct tap_header *header;
+	struct tap_frame *slots, frame;
+	unsigned int head, seq;
+	char line[] = KEY_PROTOCOL_VERSION " tap\n";
+	int ts_fd, fd, shown = 0;
+	void *map;
+
+	ts_fd = connect_ts_socket();
+	if (ts_fd < 0)
+		return ts_fd;
+	if (send(ts_fd, line, strlen(line), 0) != (int)strlen(line)) {
+		printf("Unable to send data to socket\n");
+		close(ts_fd);
+		return -30;
+	}
+	fd = receive_tap_fd(ts_fd);
+	if (fd < 0) {
+		close(ts_fd);
+		return fd;
+	}
+	map = mmap(NULL, TAP_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		printf("Unable to map tap\n");
+		close(ts_fd);
+		return -80;
+	}
+	header = map;
+	slots = (struct tap_frame *)(header + 1);
+	if (header->magic != TAP_MAGIC || header->version != TAP_VERSION ||
+		header->slot_size != sizeof(struct tap_frame)) {
+		printf("Unknown tap layout\n");
+		close(ts_fd);
+		return -80;
+	}
+
+	head = header->head;
+	while (shown < frames) {
+		if (header->head == head) {
+			usleep(2000);
+			continue;
+		}
+		// Skip ahead if the driver has lapped us
+		if (header->head - head > header->slots)
+			head = header->head - 1;
+		seq = slots[head % header->slots].seq;
+		__sync_synchronize();
+		memcpy(&frame, &slots[head % header->slots], sizeof(frame));
+		__sync_synchronize();
+		if ((seq & 1) || seq != slots[head % header->slots].seq)
+			continue;
+		print_tap_frame(&frame);
+		head++;
+		shown++;
+	}
+	munmap(map, TAP_SIZE);
+	close(ts_fd);
+	return 0;
+}
+
 int send_ts_socket(char *send_data) {
 	// Connects to the touchscreen socket
 	struct sockaddr_un unaddr;
@@ -99,6 +329,12 @@ int send_ts_socket(char *send_data) {
 				} else if ((strcmp(send_data, "S") == 0)) {
 					printf("Touchscreen set for stylus mode\n");
 					return 0;
+				} else if ((strcmp(send_data, "A") == 0)) {
+					printf("Touchscreen set for protocol A\n");
+					return 0;
+				} else if ((strcmp(send_data, "B") == 0)) {
+					printf("Touchscreen set for protocol B\n");
+					return 0;
 				} else {
 					// Get the current mode
 					return receive_ts_mode(ts_fd);
@@ -117,13 +353,29 @@ int send_ts_socket(char *send_data) {
 
 int main(int argc, char** argv)
 {
+	if (argc >= 2 && argc <= 3 && !strcmp(argv[1], "tap"))
+		return read_tap(argc == 3 ? atoi(argv[2]) : 1);
+	if (argc >= 2 && (!strcmp(argv[1], "get") ||
+		(!strcmp(argv[1], "set") && argc >= 3) ||
+		(!strcmp(argv[1], "stats") && argc == 2) ||
+		(!strcmp(argv[1], "calibrate") && argc == 2)))
+		return send_key_command(argc - 1, &argv[1]);
 	if (argc != 2 || strlen(argv[1]) != 1 ||
 		(strcmp(argv[1], "F") != 0 && strcmp(argv[1], "S") != 0 &&
-		strcmp(argv[1], "M") != 0)) {
+		strcmp(argv[1], "M") != 0 && strcmp(argv[1], "A") != 0 &&
+		strcmp(argv[1], "B") != 0)) {
 		printf("Please supply exactly 1 argument:\n");
 		printf("F to set finger mode\n");
 		printf("S to set stylus mode\n");
 		printf("M to display the current setting\n");
+		printf("A to use multi-touch protocol A\n");
+		printf("B to use multi-touch protocol B\n");
+		printf("Or get [key ...] to display tuning settings\n");
+		printf("Or set key=value [key=value ...] to change them\n");
+		printf("Or stats to display latency and health counters\n");
+		printf("Or calibrate to learn the baseline again, with nothing\n");
+		printf("touching the screen\n");
+		printf("Or tap [frames] to display the frames being processed\n");
 		printf("This is used to set the mode of operation for the\n");
 		printf("touchscreen driver on the TouchPad\n");
 		return -1;